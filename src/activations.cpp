@@ -0,0 +1,243 @@
+#include "activations.h"
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ACT_X86
+#endif
+
+namespace act{
+
+namespace {
+const double EXP_MIN = -708.0;
+const double EXP_MAX = 708.0;
+const double LOG2E = 1.4426950408889634;
+const double LN2_HI = 0.693145751953125;           // ln 2 = LN2_HI + LN2_LO, LN2_HI * n is exact
+const double LN2_LO = 1.42860682030941723212e-6;
+const double ROUND = 6755399441055744.0;            // 1.5 * 2^52: x + ROUND rounds x to an integer
+
+// Taylor coefficients of e^r (1/k!)
+const double C2 = 1.0 / 2;
+const double C3 = 1.0 / 6;
+const double C4 = 1.0 / 24;
+const double C5 = 1.0 / 120;
+const double C6 = 1.0 / 720;
+const double C7 = 1.0 / 5040;
+
+inline double exp_scalar(double x){
+    x = std::min(std::max(x, EXP_MIN), EXP_MAX);
+    double n = (x * LOG2E + ROUND) - ROUND;
+    double r = x - n * LN2_HI - n * LN2_LO;
+    double p = C7;
+    p = p * r + C6;
+    p = p * r + C5;
+    p = p * r + C4;
+    p = p * r + C3;
+    p = p * r + C2;
+    p = p * r + 1.0;
+    p = p * r + 1.0;
+    int64_t bits = (int64_t(n) + 1023) << 52;
+    double scale;
+    memcpy(&scale, &bits, sizeof(double));
+    return p * scale;
+}
+
+void exp_scalar(const double *x, double *y, int n){
+    for (int i = 0; i < n; i++){
+        y[i] = exp_scalar(x[i]);
+    }
+}
+
+void sigmoid_scalar(const double *x, double *y, int n){
+    for (int i = 0; i < n; i++){
+        y[i] = 1.0 / (1.0 + exp_scalar(-x[i]));
+    }
+}
+
+void tanh_scalar(const double *x, double *y, int n){
+    for (int i = 0; i < n; i++){
+        y[i] = 1.0 - 2.0 / (1.0 + exp_scalar(2.0 * x[i]));
+    }
+}
+
+#ifdef ACT_X86
+
+///////////////////// AVX2 + FMA: 4 doubles
+
+__attribute__((target("avx2,fma")))
+inline __m256d exp_avx2(__m256d x){
+    const __m256d round = _mm256_set1_pd(ROUND);
+    x = _mm256_min_pd(_mm256_max_pd(x, _mm256_set1_pd(EXP_MIN)), _mm256_set1_pd(EXP_MAX));
+    __m256d t = _mm256_fmadd_pd(x, _mm256_set1_pd(LOG2E), round);   // round(x log2 e) in low bits
+    __m256d n = _mm256_sub_pd(t, round);
+    __m256d r = _mm256_fnmadd_pd(n, _mm256_set1_pd(LN2_HI), x);
+    r = _mm256_fnmadd_pd(n, _mm256_set1_pd(LN2_LO), r);
+    __m256d p = _mm256_set1_pd(C7);
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(C6));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(C5));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(C4));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(C3));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(C2));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0));
+    // 2^n: n = bits(t) - bits(ROUND) (same exponent), shifted in the exponent field
+    __m256i k = _mm256_sub_epi64(_mm256_castpd_si256(t), _mm256_castpd_si256(round));
+    k = _mm256_slli_epi64(_mm256_add_epi64(k, _mm256_set1_epi64x(1023)), 52);
+    return _mm256_mul_pd(p, _mm256_castsi256_pd(k));
+}
+
+__attribute__((target("avx2,fma")))
+void exp_avx2(const double *x, double *y, int n){
+    int i = 0;
+    for (; i + 4 <= n; i += 4){
+        _mm256_storeu_pd(y + i, exp_avx2(_mm256_loadu_pd(x + i)));
+    }
+    exp_scalar(x + i, y + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+void sigmoid_avx2(const double *x, double *y, int n){
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d zero = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= n; i += 4){
+        __m256d e = exp_avx2(_mm256_sub_pd(zero, _mm256_loadu_pd(x + i)));
+        _mm256_storeu_pd(y + i, _mm256_div_pd(one, _mm256_add_pd(one, e)));
+    }
+    sigmoid_scalar(x + i, y + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+void tanh_avx2(const double *x, double *y, int n){
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d two = _mm256_set1_pd(2.0);
+    int i = 0;
+    for (; i + 4 <= n; i += 4){
+        __m256d e = exp_avx2(_mm256_mul_pd(two, _mm256_loadu_pd(x + i)));
+        _mm256_storeu_pd(y + i, _mm256_sub_pd(one, _mm256_div_pd(two, _mm256_add_pd(one, e))));
+    }
+    tanh_scalar(x + i, y + i, n - i);
+}
+
+///////////////////// AVX-512: 8 doubles
+
+// gcc 12 warns about the _mm512_undefined_* placeholders used in avx512fintrin.h
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target("avx512f")))
+inline __m512d exp_avx512(__m512d x){
+    const __m512d round = _mm512_set1_pd(ROUND);
+    x = _mm512_min_pd(_mm512_max_pd(x, _mm512_set1_pd(EXP_MIN)), _mm512_set1_pd(EXP_MAX));
+    __m512d t = _mm512_fmadd_pd(x, _mm512_set1_pd(LOG2E), round);
+    __m512d n = _mm512_sub_pd(t, round);
+    __m512d r = _mm512_fnmadd_pd(n, _mm512_set1_pd(LN2_HI), x);
+    r = _mm512_fnmadd_pd(n, _mm512_set1_pd(LN2_LO), r);
+    __m512d p = _mm512_set1_pd(C7);
+    p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(C6));
+    p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(C5));
+    p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(C4));
+    p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(C3));
+    p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(C2));
+    p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.0));
+    p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.0));
+    __m512i k = _mm512_sub_epi64(_mm512_castpd_si512(t), _mm512_castpd_si512(round));
+    k = _mm512_slli_epi64(_mm512_add_epi64(k, _mm512_set1_epi64(1023)), 52);
+    return _mm512_mul_pd(p, _mm512_castsi512_pd(k));
+}
+
+__attribute__((target("avx512f")))
+void exp_avx512(const double *x, double *y, int n){
+    int i = 0;
+    for (; i + 8 <= n; i += 8){
+        _mm512_storeu_pd(y + i, exp_avx512(_mm512_loadu_pd(x + i)));
+    }
+    exp_scalar(x + i, y + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+void sigmoid_avx512(const double *x, double *y, int n){
+    const __m512d one = _mm512_set1_pd(1.0);
+    const __m512d zero = _mm512_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= n; i += 8){
+        __m512d e = exp_avx512(_mm512_sub_pd(zero, _mm512_loadu_pd(x + i)));
+        _mm512_storeu_pd(y + i, _mm512_div_pd(one, _mm512_add_pd(one, e)));
+    }
+    sigmoid_scalar(x + i, y + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+void tanh_avx512(const double *x, double *y, int n){
+    const __m512d one = _mm512_set1_pd(1.0);
+    const __m512d two = _mm512_set1_pd(2.0);
+    int i = 0;
+    for (; i + 8 <= n; i += 8){
+        __m512d e = exp_avx512(_mm512_mul_pd(two, _mm512_loadu_pd(x + i)));
+        _mm512_storeu_pd(y + i, _mm512_sub_pd(one, _mm512_div_pd(two, _mm512_add_pd(one, e))));
+    }
+    tanh_scalar(x + i, y + i, n - i);
+}
+
+#pragma GCC diagnostic pop
+#endif
+}
+
+int detect_isa(){
+#ifdef ACT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")){
+        return AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+        return AVX2;
+    }
+#endif
+    return SCALAR;
+}
+
+const char* isa_name(int isa){
+    switch (isa){
+    case AVX512: return "avx512";
+    case AVX2: return "avx2";
+    default: return "scalar";
+    }
+}
+
+int isa = detect_isa();
+
+void exp(const double *x, double *y, int n){
+    switch (isa){
+#ifdef ACT_X86
+    case AVX512: exp_avx512(x, y, n); break;
+    case AVX2: exp_avx2(x, y, n); break;
+#endif
+    default: exp_scalar(x, y, n);
+    }
+}
+
+void sigmoid(const double *x, double *y, int n){
+    switch (isa){
+#ifdef ACT_X86
+    case AVX512: sigmoid_avx512(x, y, n); break;
+    case AVX2: sigmoid_avx2(x, y, n); break;
+#endif
+    default: sigmoid_scalar(x, y, n);
+    }
+}
+
+void tanh(const double *x, double *y, int n){
+    switch (isa){
+#ifdef ACT_X86
+    case AVX512: tanh_avx512(x, y, n); break;
+    case AVX2: tanh_avx2(x, y, n); break;
+#endif
+    default: tanh_scalar(x, y, n);
+    }
+}
+
+}
@@ -0,0 +1,30 @@
+#ifndef ACTIVATIONS_H
+#define ACTIVATIONS_H
+
+// Fast vectorized approximations of exp, sigmoid and tanh on arrays
+// of doubles. Instruction set (AVX-512, AVX2+FMA or scalar code)
+// is selected at runtime.
+//
+// exp(x): range reduction x = n ln2 + r, |r| <= ln2/2, and degree 7
+// polynomial for e^r. Inputs are clamped to [-708, 708] (no overflow,
+// no denormals). Relative error < 1e-8 on that range.
+// sigmoid(x) = 1 / (1 + exp(-x)) and tanh(x) = 1 - 2 / (1 + exp(2x)):
+// absolute error < 1e-8.
+namespace act{
+
+enum {SCALAR, AVX2, AVX512};
+
+int detect_isa();                   // best instruction set supported by the cpu
+const char* isa_name(int isa);
+
+// Instruction set used by the functions below (detect_isa() by default).
+// Can be lowered (e.g. to compare implementations), not raised above detect_isa().
+extern int isa;
+
+void exp(const double *x, double *y, int n);
+void sigmoid(const double *x, double *y, int n);
+void tanh(const double *x, double *y, int n);
+
+}
+
+#endif // ACTIVATIONS_H
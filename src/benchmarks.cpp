@@ -0,0 +1,559 @@
+#include <benchmark/benchmark.h>
+#include <unistd.h>
+#include <cstdio>
+
+#include "conll_utils.h"
+#include "bilstm_tagger.h"
+#include "synthetic_corpus.h"
+#include "neural_net_hyperparameters.h"
+#include "activations.h"
+#include "quantization.h"
+
+/////////////////////////////////////////////////////////////////
+///
+/// Microbenchmarks (Google Benchmark).
+///
+/// All data is synthetic (see synthetic_corpus.h), so that the
+/// suite runs offline. Machine-readable results:
+///    ./bench --benchmark_out=bench.json --benchmark_out_format=json
+///
+/////////////////////////////////////////////////////////////////
+
+using namespace std;
+
+/**
+ * @brief The BenchData struct holds the synthetic corpus
+ * and the (global) encoders shared by all benchmarks.
+ * It is built once, on first use.
+ */
+struct BenchData{
+    string corpus_file;
+    long corpus_bytes;
+    int corpus_tokens;
+    ConllTreebank train;
+    NeuralNetParameters params;
+
+    BenchData(){
+        char tmp[] = "/tmp/tagger_bench_XXXXXX";
+        int fd = mkstemp(tmp);
+        assert(fd != -1);
+        close(fd);
+        corpus_file = tmp;
+
+        SyntheticCorpus generator;
+        generator.n_sentences = 2000;
+        generator.vocsize = 2000;
+        generator.write(corpus_file);
+
+        read_conll_corpus(corpus_file, train, true);
+        train.update_vocsize_and_frequencies();
+        enc::hodor.update_wordform_frequencies(train.get_frequencies_dict());
+
+        std::ifstream in(corpus_file, std::ifstream::ate | std::ifstream::binary);
+        corpus_bytes = in.tellg();
+        corpus_tokens = 0;
+        for (int i = 0; i < train.size(); i++){
+            corpus_tokens += train.sentence_size(i);
+        }
+
+        production_hyperparameters(params);
+    }
+
+    ~BenchData(){
+        remove(corpus_file.c_str());
+    }
+
+    static BenchData& get(){
+        static BenchData data;
+        return data;
+    }
+};
+
+
+/////////////////////////////////////////////////////////////////
+/// Layers
+
+template <class L>
+struct LayerFactory{
+    static Layer* make(int size){ return new L(); }
+};
+template <> struct LayerFactory<AffineLayer>{
+    static Layer* make(int size){ return new AffineLayer(size, size); }
+};
+template <> struct LayerFactory<LinearLayer>{
+    static Layer* make(int size){ return new LinearLayer(size, size); }
+};
+template <> struct LayerFactory<MultipleLinearLayer>{
+    static Layer* make(int size){
+        vector<int> sizes{size, size};
+        return new MultipleLinearLayer(2, sizes, size);
+    }
+};
+template <> struct LayerFactory<RecurrentLayer>{
+    static Layer* make(int size){ return new RecurrentLayer(size, size); }
+};
+template <> struct LayerFactory<AddBias>{
+    static Layer* make(int size){ return new AddBias(size); }
+};
+template <> struct LayerFactory<ConstantLayer>{
+    static Layer* make(int size){ return new ConstantLayer(size); }
+};
+
+static void BM_Layer(benchmark::State &state, Layer* (*make)(int), int n_inputs, bool backward){
+    int size = state.range(0);
+    shared_ptr<Layer> layer(make(size));
+    layer->target = 0;
+
+    vector<Vec> x(n_inputs), dx(n_inputs);
+    vector<Vec*> data, gradient;
+    for (int i = 0; i < n_inputs; i++){
+        x[i] = Vec::Random(size).array() + 1.5;   // > 0: Sqrt, Div
+        dx[i] = Vec::Zero(size);
+    }
+    for (int i = 0; i < n_inputs; i++){
+        data.push_back(&x[i]);
+        gradient.push_back(&dx[i]);
+    }
+    Vec output = Vec::Zero(size);
+    Vec out_derivative = Vec::Random(size) / 100.0;
+
+    layer->fprop(data, output);
+    for (auto _ : state){
+        if (backward){
+            layer->bprop(data, output, out_derivative, gradient);
+        }else{
+            layer->fprop(data, output);
+        }
+        benchmark::DoNotOptimize(output.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * size);
+}
+
+#define LAYER_BENCHMARK(L, n_inputs) \
+    BENCHMARK_CAPTURE(BM_Layer, L##_fprop, &LayerFactory<L>::make, n_inputs, false)->RangeMultiplier(2)->Range(32, 512); \
+    BENCHMARK_CAPTURE(BM_Layer, L##_bprop, &LayerFactory<L>::make, n_inputs, true)->RangeMultiplier(2)->Range(32, 512);
+
+LAYER_BENCHMARK(AffineLayer, 1)
+LAYER_BENCHMARK(LinearLayer, 1)
+LAYER_BENCHMARK(MultipleLinearLayer, 2)
+LAYER_BENCHMARK(RecurrentLayer, 2)
+LAYER_BENCHMARK(AddBias, 1)
+LAYER_BENCHMARK(ConstantLayer, 0)
+LAYER_BENCHMARK(Mult, 2)
+LAYER_BENCHMARK(Add, 2)
+LAYER_BENCHMARK(Mixture, 3)
+LAYER_BENCHMARK(Minus, 2)
+LAYER_BENCHMARK(Mean, 1)
+LAYER_BENCHMARK(Div, 2)
+LAYER_BENCHMARK(Sqrt, 1)
+LAYER_BENCHMARK(Square, 1)
+LAYER_BENCHMARK(Tanh, 1)
+LAYER_BENCHMARK(Sigmoid, 1)
+LAYER_BENCHMARK(ReLU, 1)
+LAYER_BENCHMARK(Softmax, 1)
+
+
+/////////////////////////////////////////////////////////////////
+/// Activation kernels: exact (Eigen / libm) vs fast approximations
+/// for each instruction set supported by the cpu.
+/// Counter max_error: max absolute error (relative error for exp)
+/// against the exact version on inputs in [-range, range].
+
+enum {EXP, SIGMOID, TANH};
+
+static void exact_activation(int function, const Vec &x, Vec &y){
+    switch (function){
+    case EXP:     y = x.array().exp(); break;
+    case SIGMOID: y = 1.0 / (1.0 + (-x).array().exp()); break;
+    case TANH:    y = x.array().tanh(); break;
+    }
+}
+
+static void fast_activation(int function, const Vec &x, Vec &y){
+    switch (function){
+    case EXP:     act::exp(x.data(), y.data(), x.size()); break;
+    case SIGMOID: act::sigmoid(x.data(), y.data(), x.size()); break;
+    case TANH:    act::tanh(x.data(), y.data(), x.size()); break;
+    }
+}
+
+// isa < 0: exact version
+static void BM_activation(benchmark::State &state, int function, int isa){
+    if (isa > act::detect_isa()){
+        state.SkipWithError("instruction set not supported");
+        return;
+    }
+    int size = state.range(0);
+    double range = function == EXP ? 20.0 : 10.0;
+    Vec x = Vec::Random(size) * range;
+    Vec exact(size);
+    Vec y(size);
+    exact_activation(function, x, exact);
+
+    int default_isa = act::isa;
+    if (isa >= 0){
+        act::isa = isa;
+    }
+    for (auto _ : state){
+        if (isa < 0){
+            exact_activation(function, x, y);
+        }else{
+            fast_activation(function, x, y);
+        }
+        benchmark::DoNotOptimize(y.data());
+        benchmark::ClobberMemory();
+    }
+    act::isa = default_isa;
+
+    Vec error = (y - exact).cwiseAbs();
+    if (function == EXP){
+        error = error.cwiseQuotient(exact);
+    }
+    state.counters["max_error"] = error.maxCoeff();
+    state.SetItemsProcessed(state.iterations() * size);
+}
+
+#define ACTIVATION_BENCHMARK(name, function) \
+    BENCHMARK_CAPTURE(BM_activation, name##_exact, function, -1)->Arg(32)->Arg(128)->Arg(1024); \
+    BENCHMARK_CAPTURE(BM_activation, name##_scalar, function, act::SCALAR)->Arg(32)->Arg(128)->Arg(1024); \
+    BENCHMARK_CAPTURE(BM_activation, name##_avx2, function, act::AVX2)->Arg(32)->Arg(128)->Arg(1024); \
+    BENCHMARK_CAPTURE(BM_activation, name##_avx512, function, act::AVX512)->Arg(32)->Arg(128)->Arg(1024);
+
+ACTIVATION_BENCHMARK(exp, EXP)
+ACTIVATION_BENCHMARK(sigmoid, SIGMOID)
+ACTIVATION_BENCHMARK(tanh, TANH)
+
+
+/////////////////////////////////////////////////////////////////
+/// Matrix-vector product: double (Eigen) vs int8 weights
+/// for each instruction set supported by the cpu.
+/// Counter error: |y_int8 - y| / |y|
+
+// isa < 0: Eigen double
+static void BM_gemv(benchmark::State &state, int isa){
+    if (isa > q8::detect_isa()){
+        state.SkipWithError("instruction set not supported");
+        return;
+    }
+    int size = state.range(0);
+    Mat w = xavier(size, size);
+    Vec x = Vec::Random(size);
+    Vec exact = w * x;
+    Vec y(size);
+    QMat qw;
+    qw.quantize(w);
+
+    int default_isa = q8::isa;
+    if (isa >= 0){
+        q8::isa = isa;
+    }
+    for (auto _ : state){
+        if (isa < 0){
+            y.noalias() = w * x;
+        }else{
+            qw.gemv(x.data(), y.data());
+        }
+        benchmark::DoNotOptimize(y.data());
+        benchmark::ClobberMemory();
+    }
+    q8::isa = default_isa;
+
+    state.counters["error"] = (y - exact).norm() / exact.norm();
+    state.SetItemsProcessed(state.iterations() * w.size());
+}
+BENCHMARK_CAPTURE(BM_gemv, double, -1)->RangeMultiplier(2)->Range(32, 512);
+BENCHMARK_CAPTURE(BM_gemv, int8_scalar, q8::SCALAR)->RangeMultiplier(2)->Range(32, 512);
+BENCHMARK_CAPTURE(BM_gemv, int8_avx2, q8::AVX2)->RangeMultiplier(2)->Range(32, 512);
+BENCHMARK_CAPTURE(BM_gemv, int8_vnni, q8::AVX512_VNNI)->RangeMultiplier(2)->Range(32, 512);
+
+
+/////////////////////////////////////////////////////////////////
+/// Parameter update (SGD step, ASGD accumulator, noise, clipping)
+
+static void BM_MatParam_update(benchmark::State &state, bool gaussian, bool clipping){
+    int size = state.range(0);
+    Mat w = Mat::Random(size, size);
+    Mat dw = Mat::Zero(size, size);
+    Mat cw = Mat::Zero(size, size);
+    Mat g = Mat::Random(size, size);
+    MatParam param(&w, &dw, &cw);
+    double T = 1;
+    for (auto _ : state){
+        dw = g;
+        param.update(0.02, T++, 5.0, clipping, gaussian, 0.01);
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * w.size());
+}
+BENCHMARK_CAPTURE(BM_MatParam_update, sgd, false, false)->RangeMultiplier(2)->Range(32, 512);
+BENCHMARK_CAPTURE(BM_MatParam_update, clip, false, true)->RangeMultiplier(2)->Range(32, 512);
+BENCHMARK_CAPTURE(BM_MatParam_update, noise_clip, true, true)->RangeMultiplier(2)->Range(32, 512);
+
+// Output layers of all tasks for a sentence of range(0) tokens (upos, xpos and
+// 5 morphological features, inputs: 2 x 64): probabilities or logits only (argmax)
+static void BM_FusedSoftmaxHead(benchmark::State &state, bool normalize){
+    vector<int> input_sizes{64, 64};
+    vector<int> n_classes{18, 48, 4, 6, 3, 3, 5};
+    vector<shared_ptr<MultipleLinearLayer>> layers;
+    vector<MultipleLinearLayer*> tasks;
+    for (int n : n_classes){
+        layers.push_back(shared_ptr<MultipleLinearLayer>(new MultipleLinearLayer(2, input_sizes, n)));
+        tasks.push_back(layers.back().get());
+    }
+    FusedSoftmaxHead head;
+    head.set_tasks(tasks);
+    head.x = Mat::Random(head.input_size(), state.range(0));
+    for (auto _ : state){
+        head.fprop(normalize);
+        benchmark::DoNotOptimize(head.p.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK_CAPTURE(BM_FusedSoftmaxHead, softmax, true)->Arg(20)->Arg(100);
+BENCHMARK_CAPTURE(BM_FusedSoftmaxHead, logits, false)->Arg(20)->Arg(100);
+
+
+/////////////////////////////////////////////////////////////////
+/// Recurrent cells: cost of a single time step
+
+static AbstractNeuralNode* make_cell(int cell_type, int size,
+                                     shared_ptr<AbstractNeuralNode> &pred,
+                                     vector<shared_ptr<AbstractNeuralNode>> &input,
+                                     RecurrentLayerWrapper &layers){
+    switch (cell_type){
+    case RecurrentLayerWrapper::GRU:     return new GruNode(size, pred, input, layers);
+    case RecurrentLayerWrapper::LSTM:    return new LstmNode(size, pred, input, layers);
+    case RecurrentLayerWrapper::LN_LSTM: return new LnLstmNode(size, pred, input, layers);
+    default:
+        assert(false && "Unknown recurrent cell type");
+    }
+    return nullptr;
+}
+
+static void BM_Cell(benchmark::State &state, int cell_type, bool backward){
+    int size = state.range(0);
+    vector<int> input_sizes{size};
+    RecurrentLayerWrapper layers(cell_type, input_sizes, size);
+
+    shared_ptr<ParamNode> h0(new ParamNode(size, layers[GruNode::INIT2]));
+    shared_ptr<AbstractNeuralNode> init(new MemoryNodeInitial(size, layers[GruNode::INIT1], h0));
+    init->fprop();
+
+    Vec e = Vec::Random(size);
+    Vec de = Vec::Zero(size);
+    Vec ce = Vec::Zero(size);
+    VecParam embedding(&e, &de, &ce);
+    vector<shared_ptr<AbstractNeuralNode>> input{shared_ptr<AbstractNeuralNode>(new LookupNode(embedding))};
+
+    shared_ptr<AbstractNeuralNode> node(make_cell(cell_type, size, init, input, layers));
+    node->fprop();
+    for (auto _ : state){
+        node->fprop();
+        if (backward){
+            node->bprop();
+        }
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+#define CELL_BENCHMARK(name, cell_type) \
+    BENCHMARK_CAPTURE(BM_Cell, name##_fprop, cell_type, false)->RangeMultiplier(2)->Range(32, 512); \
+    BENCHMARK_CAPTURE(BM_Cell, name##_fprop_bprop, cell_type, true)->RangeMultiplier(2)->Range(32, 512);
+
+CELL_BENCHMARK(LstmNode, RecurrentLayerWrapper::LSTM)
+CELL_BENCHMARK(LnLstmNode, RecurrentLayerWrapper::LN_LSTM)
+CELL_BENCHMARK(GruNode, RecurrentLayerWrapper::GRU)
+
+
+/////////////////////////////////////////////////////////////////
+/// Feature extractors
+
+static void BM_BiRnnFeatureExtractor(benchmark::State &state, bool train, bool projection){
+    RunMode::input_projection = projection;
+    BenchData &bd = BenchData::get();
+    int length = state.range(0);
+    NeuralNetParameters params = bd.params;
+    LookupTable lu(enc::hodor.size(enc::TOK), params.topology.embedding_size_type[enc::TOK]);
+    BiRnnFeatureExtractor rnn(&params, &lu);
+    rnn.set_train_time(train);
+
+    std::mt19937 gen(1);
+    vector<STRCODE> X;
+    SyntheticCorpus::random_sentence(length, X, gen);
+
+    for (auto _ : state){
+        rnn.build_computation_graph(X);
+        rnn.fprop();
+        if (train){
+            rnn.bprop();
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * length);
+    RunMode::input_projection = true;
+}
+// _step: input side of the gates computed at each timestep (RunMode::input_projection off)
+BENCHMARK_CAPTURE(BM_BiRnnFeatureExtractor, fprop, false, true)->Arg(5)->Arg(10)->Arg(20)->Arg(50)->Arg(100)->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(BM_BiRnnFeatureExtractor, fprop_step, false, false)->Arg(5)->Arg(10)->Arg(20)->Arg(50)->Arg(100)->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(BM_BiRnnFeatureExtractor, fprop_bprop, true, true)->Arg(5)->Arg(10)->Arg(20)->Arg(50)->Arg(100)->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(BM_BiRnnFeatureExtractor, fprop_bprop_step, true, false)->Arg(5)->Arg(10)->Arg(20)->Arg(50)->Arg(100)->Unit(benchmark::kMicrosecond);
+
+// Forward pass of one sentence on range(1) threads (directions and char-based words in parallel)
+static void BM_BiRnnFeatureExtractor_threads(benchmark::State &state){
+    BenchData &bd = BenchData::get();
+    int length = state.range(0);
+    NeuralNetParameters params = bd.params;
+    LookupTable lu(enc::hodor.size(enc::TOK), params.topology.embedding_size_type[enc::TOK]);
+    BiRnnFeatureExtractor rnn(&params, &lu);
+    rnn.set_threads(state.range(1));
+
+    std::mt19937 gen(1);
+    vector<STRCODE> X;
+    SyntheticCorpus::random_sentence(length, X, gen);
+
+    for (auto _ : state){
+        rnn.build_computation_graph(X);
+        rnn.fprop();
+    }
+    state.SetItemsProcessed(state.iterations() * length);
+}
+BENCHMARK(BM_BiRnnFeatureExtractor_threads)->ArgsProduct({{50, 200}, {1, 2, 4}})->Unit(benchmark::kMicrosecond);
+
+
+static void BM_precompute_lstm_char(benchmark::State &state){
+    BenchData &bd = BenchData::get();
+    NeuralNetParameters params = bd.params;
+    CharBiRnnFeatureExtractor char_rnn(&params.rnn.crnn);
+    char_rnn.init_encoders();
+    for (auto _ : state){
+        char_rnn.precompute_lstm_char();
+    }
+    state.SetItemsProcessed(state.iterations() * enc::hodor.size(enc::TOK));
+}
+BENCHMARK(BM_precompute_lstm_char)->Unit(benchmark::kMillisecond);
+
+
+/////////////////////////////////////////////////////////////////
+/// Corpus reading
+
+static void BM_read_conll_corpus(benchmark::State &state){
+    BenchData &bd = BenchData::get();
+    for (auto _ : state){
+        ConllTreebank tbk;
+        read_conll_corpus(bd.corpus_file, tbk, false);
+        benchmark::DoNotOptimize(tbk.size());
+    }
+    state.SetBytesProcessed(state.iterations() * bd.corpus_bytes);
+    state.SetItemsProcessed(state.iterations() * bd.corpus_tokens);
+}
+BENCHMARK(BM_read_conll_corpus)->Unit(benchmark::kMillisecond);
+
+static void BM_to_training_example(benchmark::State &state, string output_code){
+    BenchData &bd = BenchData::get();
+    Output output(output_code);
+    output.update_bigrams(bd.train);
+    output.max_chars = enc::hodor.longest_size(enc::TOK) + 1;
+    output.get_output_sizes();
+    bd.train.compute_labels(output);
+
+    vector<STRCODE> X;
+    LabelView Y;
+    long tokens = 0;
+    for (auto _ : state){
+        for (int i = 0; i < bd.train.size(); i++){
+            bd.train.to_training_example(i, X, Y, output);
+            benchmark::DoNotOptimize(Y.data);
+            tokens += X.size();
+        }
+    }
+    state.SetItemsProcessed(tokens);
+}
+BENCHMARK_CAPTURE(BM_to_training_example, upos, string(""))->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_to_training_example, xmbB, string("xmbB"))->Unit(benchmark::kMillisecond);
+
+
+/////////////////////////////////////////////////////////////////
+/// End-to-end tagger: items_per_second = tokens / second
+
+// top_k > 0: predict_one with the top_k labels and their probabilities (softmax computed)
+static void BM_Tagger(benchmark::State &state, string output_code, bool train, bool fast, int top_k){
+    BenchData &bd = BenchData::get();
+    NeuralNetParameters params = bd.params;
+    params.fast_activations = fast;
+    Output output(output_code);
+    output.update_bigrams(bd.train);
+    output.max_chars = enc::hodor.longest_size(enc::TOK) + 1;
+    output.get_output_sizes();
+
+    bd.train.compute_labels(output);
+
+    BiLstmTagger tagger(enc::hodor.size(enc::TOK), output.n_labels, params);
+    if (! train){
+        tagger.precompute_char_lstm();
+    }
+
+    vector<STRCODE> X;
+    LabelView Y;
+    vector<vector<int>> predictions;
+    TopLabels top;
+    int i = 0;
+    long tokens = 0;
+    for (auto _ : state){
+        bd.train.to_training_example(i, X, Y, output);
+        if (train){
+            tagger.train_one(X, Y);
+        }else if (top_k > 0){
+            tagger.predict_one(X, predictions, top_k, top);
+        }else{
+            tagger.predict_one(X, predictions);
+        }
+        tokens += X.size();
+        i = (i + 1) % bd.train.size();
+    }
+    state.SetItemsProcessed(tokens);
+}
+BENCHMARK_CAPTURE(BM_Tagger, predict_one, string(""), false, false, 0)->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(BM_Tagger, predict_one_xm, string("xm"), false, false, 0)->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(BM_Tagger, predict_one_fast, string(""), false, true, 0)->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(BM_Tagger, predict_one_top3, string(""), false, false, 3)->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(BM_Tagger, predict_one_xm_top3, string("xm"), false, false, 3)->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(BM_Tagger, train_one, string(""), true, false, 0)->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(BM_Tagger, train_one_xm, string("xm"), true, false, 0)->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(BM_Tagger, train_one_fast, string(""), true, true, 0)->Unit(benchmark::kMicrosecond);
+
+// predict_one with a prediction cache, over the first range(0) sentences of the corpus
+// (all hits after the first pass): cost of a lookup
+static void BM_Tagger_cached(benchmark::State &state){
+    BenchData &bd = BenchData::get();
+    NeuralNetParameters params = bd.params;
+    Output output("");
+    output.update_bigrams(bd.train);
+    output.max_chars = enc::hodor.longest_size(enc::TOK) + 1;
+    output.get_output_sizes();
+    bd.train.compute_labels(output);
+
+    BiLstmTagger tagger(enc::hodor.size(enc::TOK), output.n_labels, params);
+    tagger.precompute_char_lstm();
+    shared_ptr<PredictionCache> cache(new PredictionCache(64 * 1024 * 1024));
+    tagger.set_prediction_cache(cache);
+
+    int n = std::min<int>(state.range(0), bd.train.size());
+    vector<STRCODE> X;
+    LabelView Y;
+    vector<vector<int>> predictions;
+    int i = 0;
+    long tokens = 0;
+    for (auto _ : state){
+        bd.train.to_training_example(i, X, Y, output);
+        tagger.predict_one(X, predictions);
+        tokens += X.size();
+        i = (i + 1) % n;
+    }
+    state.SetItemsProcessed(tokens);
+    state.counters["hit_rate"] = double(cache->hits) / std::max<size_t>(1, cache->hits + cache->misses);
+}
+BENCHMARK(BM_Tagger_cached)->Arg(100)->Unit(benchmark::kMicrosecond);
+
+
+BENCHMARK_MAIN();
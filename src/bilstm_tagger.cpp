@@ -2,9 +2,11 @@
 
 #include "bilstm_tagger.h"
 
+std::atomic<uint64_t> BiLstmTagger::n_model_ids(0);
 
 BiLstmTagger::BiLstmTagger(int vocsize, vector<int> &n_classes, NeuralNetParameters &params):
-    n_updates_(0), T_(0), n_classes_(n_classes), voc_size(vocsize), params_(params){
+    n_updates_(0), T_(0), n_classes_(n_classes), voc_size(vocsize), params_(params),
+    fused_(false), window_size(0), window_context(0), normalized_(true){
 
     hidden_size = params_.topology.size_hidden_layers;
     n_hidden = params_.topology.n_hidden_layers;
@@ -37,16 +39,39 @@ BiLstmTagger::BiLstmTagger(int vocsize, vector<int> &n_classes, NeuralNetParamet
     for (int i = 0; i < layers.size(); i++){
         for (int j = 0; j < layers[i].size(); j++){
             layers[i][j]->get_params(this->parameters);
+            layers[i][j]->set_fast_activations(params_.fast_activations);
         }
     }
+    for (int i = 0; i < parameters.size(); i++){
+        parameters[i]->optimizer = &params_.optimizer;
+    }
+    lu.optimizer = &params_.optimizer;
     rnn = BiRnnFeatureExtractor(&params_, &lu);
+    set_head_tasks();
+    new_model_id();
+}
+
+void BiLstmTagger::set_head_tasks(){
+    if (n_hidden > 0){
+        return;
+    }
+    vector<MultipleLinearLayer*> tasks;
+    for (int t = 0; t < layers.size(); t++){
+        tasks.push_back(static_cast<MultipleLinearLayer*>(layers[t][0].get()));
+    }
+    head.set_tasks(tasks);
+    head.fast = params_.fast_activations;
+}
+
+bool BiLstmTagger::use_fused_head(){
+    return n_hidden == 0 && head.tasks[0]->layers[0]->qw.empty();
 }
 
 double BiLstmTagger::get_learning_rate(){
     return params_.learning_rate / (1.0 + T_ * params_.decrease_constant);
 }
 
-void BiLstmTagger::train_one(vector<STRCODE> &X, vector<vector<int>> &Y){
+void BiLstmTagger::train_one(vector<STRCODE> &X, const LabelView &Y){
     rnn.set_train_time(true);
 
     this->fprop(X);
@@ -59,21 +84,106 @@ void BiLstmTagger::train_one(vector<STRCODE> &X, vector<vector<int>> &Y){
 }
 
 void BiLstmTagger::predict_one(vector<STRCODE> &X, vector<vector<int>> &Y){
+    if (cache == nullptr){
+        predict(X, Y);
+        return;
+    }
+    if (! cache->get(model_id, X, Y)){
+        predict(X, Y);
+        cache->put(model_id, X, Y);
+    }
+}
+
+void BiLstmTagger::predict_one(vector<STRCODE> &X, vector<vector<int>> &Y, int k, TopLabels &top){
+    predict(X, Y, k, &top);
+}
+
+void BiLstmTagger::predict(vector<STRCODE> &X, vector<vector<int>> &Y, int k, TopLabels *top){
     rnn.set_train_time(false);
-    this->fprop(X);
-    this->get_predictions(Y);
+    bool normalize = top != nullptr;
+    if (window_size == 0 || X.size() <= window_size){
+        this->fprop(X, normalize);
+        this->get_predictions(Y);
+        if (top != nullptr){
+            get_top_labels(k, *top);
+        }
+        return;
+    }
+    Y.resize(X.size());
+    if (top != nullptr){
+        top->resize(X.size());
+    }
+    vector<vector<int>> window_predictions;
+    TopLabels window_top;
+    int first, end, last;
+    for (int begin = 0; begin < X.size(); begin = end){
+        fprop_window(X, begin, first, end, last, normalize);
+        get_predictions(window_predictions);
+        for (int i = begin; i < end; i++){
+            Y[i] = window_predictions[i - first];
+        }
+        if (top != nullptr){
+            get_top_labels(k, window_top);
+            for (int i = begin; i < end; i++){
+                (*top)[i] = window_top[i - first];
+            }
+        }
+    }
 }
 
-void BiLstmTagger::eval_one(vector<STRCODE> &X, vector<vector<int>> &Y, vector<vector<int>> &predictions, vector<float> &losses){
+void BiLstmTagger::eval_one(vector<STRCODE> &X, const LabelView &Y, vector<vector<int>> &predictions, vector<float> &losses){
     rnn.set_train_time(false);
-    this->fprop(X);
-    this->get_losses(losses, Y);
-    this->get_predictions(predictions);
+    if (window_size == 0 || X.size() <= window_size){
+        this->fprop(X);
+        this->get_losses(losses, Y);
+        this->get_predictions(predictions);
+        return;
+    }
+    predictions.resize(X.size());
+    vector<vector<int>> window_predictions;
+    int first, end, last;
+    for (int begin = 0; begin < X.size(); begin = end){
+        fprop_window(X, begin, first, end, last, true);
+        get_losses(losses, LabelView(Y[first], last - first, Y.cols), begin - first, end - first);
+        get_predictions(window_predictions);
+        for (int i = begin; i < end; i++){
+            predictions[i] = window_predictions[i - first];
+        }
+    }
 }
 
-void BiLstmTagger::fprop(vector<STRCODE> &X){
+void BiLstmTagger::fprop_window(vector<STRCODE> &X, int begin, int &first, int &end, int &last, bool normalize){
+    int n = X.size();
+    end = std::min(n, begin + window_size - 2 * window_context);
+    first = std::max(0, begin - window_context);
+    last = std::min(n, end + window_context);
+    window.assign(X.begin() + first, X.begin() + last);
+    this->fprop(window, normalize);
+}
+
+void BiLstmTagger::fprop(vector<STRCODE> &X, bool normalize){
     rnn.build_computation_graph(X);
     rnn.fprop();
+    normalized_ = normalize;
+
+    fused_ = use_fused_head();
+    if (fused_){
+        output_nodes.clear();
+        head.x.resize(head.input_size(), X.size());
+        vector<shared_ptr<AbstractNeuralNode>> input;
+        for (int i = 0; i < X.size(); i++){
+            input.clear();
+            rnn(i, input);
+            int r = 0;
+            for (int k = 0; k < input.size(); k++){
+                Vec *v = input[k]->v();
+                head.x.col(i).segment(r, v->size()) = *v;
+                r += v->size();
+            }
+        }
+        head.fprop(normalize);
+        return;
+    }
 
     output_nodes.resize(X.size());
 
@@ -111,18 +221,33 @@ void BiLstmTagger::fprop(vector<STRCODE> &X){
             }
         }
     }
+    int n_layers = normalize ? 0 : 1;     // last layer (softmax) skipped for argmax only
     for (int i = 0; i < output_nodes.size(); i++){
         for (int t = 0; t < output_nodes[i].size(); t++){
-            for (int l = 0; l < output_nodes[i][t].size(); l++){
+            for (int l = 0; l < output_nodes[i][t].size() - n_layers; l++){
                 output_nodes[i][t][l]->fprop();
             }
         }
     }
 }
 
-void BiLstmTagger::get_losses(vector<float> &losses, vector<vector<int>> &targets){
+void BiLstmTagger::get_losses(vector<float> &losses, const LabelView &targets, int begin, int end){
     assert(losses.size() == n_classes_.size());
-    for (int i = 0; i < output_nodes.size(); i++){
+    if (fused_){
+        if (end < 0){
+            end = head.p.cols();
+        }
+        for (int i = begin; i < end; i++){
+            for (int t = 0; t < n_classes_.size(); t++){
+                losses[t] += - log(head.p(head.offsets[t] + targets[i][t], i));
+            }
+        }
+        return;
+    }
+    if (end < 0){
+        end = output_nodes.size();
+    }
+    for (int i = begin; i < end; i++){
         //for (int t = 0; t < output_nodes[i].size(); t++){
         for (int t = 0; t < n_classes_.size(); t++){
             Vec* v = output_nodes[i][t].back()->v();
@@ -132,6 +257,18 @@ void BiLstmTagger::get_losses(vector<float> &losses, vector<vector<int>> &target
 }
 
 void BiLstmTagger::get_predictions(vector<vector<int>> &predictions){
+    if (fused_){
+        predictions.resize(head.p.cols());
+        for (int i = 0; i < head.p.cols(); i++){
+            predictions[i].resize(n_classes_.size());
+            for (int t = 0; t < n_classes_.size(); t++){
+                int argmax;
+                head.p.col(i).segment(head.offsets[t], n_classes_[t]).maxCoeff(&argmax);
+                predictions[i][t] = argmax;
+            }
+        }
+        return;
+    }
     predictions.resize(output_nodes.size());
     for (int i = 0; i < output_nodes.size(); i++){
         predictions[i].resize(n_classes_.size());
@@ -140,7 +277,8 @@ void BiLstmTagger::get_predictions(vector<vector<int>> &predictions){
 //        cerr << n_classes_.size() << endl;
 //        cerr << output_nodes[i].size() << endl;
         for (int t = 0; t < n_classes_.size(); t++){
-            Vec* v = output_nodes[i][t].back()->v();
+            const vector<shared_ptr<AbstractNeuralNode>> &nodes = output_nodes[i][t];
+            Vec* v = (normalized_ ? nodes.back() : nodes[nodes.size() - 2])->v();   // probabilities or logits
             int argmax;
             v->maxCoeff(&argmax);
             predictions[i][t] = argmax;
@@ -152,7 +290,48 @@ void BiLstmTagger::get_predictions(vector<vector<int>> &predictions){
     }
 }
 
-void BiLstmTagger::bprop(vector<vector<int>> &targets){
+void BiLstmTagger::get_top_labels(int k, TopLabels &top){
+    assert(normalized_);
+    int n = fused_ ? head.p.cols() : output_nodes.size();
+    top.resize(n);
+    vector<int> order;
+    for (int i = 0; i < n; i++){
+        top[i].resize(n_classes_.size());
+        for (int t = 0; t < n_classes_.size(); t++){
+            const double *p = fused_ ? head.p.col(i).data() + head.offsets[t] : output_nodes[i][t].back()->v()->data();
+            int m = std::min(k, n_classes_[t]);
+            order.resize(n_classes_[t]);
+            for (int c = 0; c < order.size(); c++){
+                order[c] = c;
+            }
+            std::partial_sort(order.begin(), order.begin() + m, order.end(),
+                              [p](int a, int b){ return p[a] > p[b] || (p[a] == p[b] && a < b); });
+            top[i][t].resize(m);
+            for (int r = 0; r < m; r++){
+                top[i][t][r] = {order[r], p[order[r]]};
+            }
+        }
+    }
+}
+
+void BiLstmTagger::bprop(const LabelView &targets){
+    if (fused_){
+        Mat dx;
+        head.bprop(targets, dx);
+        vector<shared_ptr<AbstractNeuralNode>> input;
+        for (int i = 0; i < dx.cols(); i++){
+            input.clear();
+            rnn(i, input);
+            int r = 0;
+            for (int k = 0; k < input.size(); k++){
+                Vec *d = input[k]->d();
+                *d += dx.col(i).segment(r, d->size());
+                r += d->size();
+            }
+        }
+        rnn.bprop();
+        return;
+    }
     for (int i = 0; i < output_nodes.size(); i++){
         for (int t = 0; t < output_nodes[i].size(); t++){
             layers[t].back()->target = targets[i][t];
@@ -170,6 +349,7 @@ void BiLstmTagger::update(double lr, double T, double clip, bool clipping, bool
     }
     rnn.update(lr, T, clip, clipping, gaussian, gaussian_eta);
     lu.update(lr, T, clip, clipping, gaussian, gaussian_eta);
+    new_model_id();
 }
 
 void BiLstmTagger::assign_parameters(BiLstmTagger *other){
@@ -178,6 +358,7 @@ void BiLstmTagger::assign_parameters(BiLstmTagger *other){
     }
     rnn.assign_parameters(other->rnn);
     rnn.copy_char_birnn(other->rnn);
+    new_model_id();
 }
 
 BiLstmTagger* BiLstmTagger::copy(){
@@ -199,6 +380,18 @@ void BiLstmTagger::average_parameters(){
     for (int i = 0; i < parameters.size(); i++){
         parameters[i]->average(T_);
     }
+    new_model_id();
+}
+
+void BiLstmTagger::assign_average(BiLstmTagger &other){
+    assert(parameters.size() == other.parameters.size());
+    double T = std::max(1, other.T_);
+    lu.assign_average(other.lu, T);
+    for (int i = 0; i < parameters.size(); i++){
+        parameters[i]->assign_average(other.parameters[i], T);
+    }
+    rnn.assign_average(other.rnn, T);
+    new_model_id();
 }
 
 void BiLstmTagger::export_model(string &output_dir){
@@ -246,7 +439,40 @@ void BiLstmTagger::import_model(string &output_dir){
     for (int i = 0; i < parameters.size(); i++){
         parameters[i]->load(output_dir+"/parameters" + std::to_string(i));
     }
+    precompute_char_lstm();
+}
+
+void BiLstmTagger::precompute_char_lstm(){
     rnn.precompute_char_lstm();
+    new_model_id();
+}
+
+void BiLstmTagger::quantize(){
+    vector<shared_ptr<Parameter>> weights(parameters);
+    rnn.get_parameters(weights);
+    for (int i = 0; i < weights.size(); i++){
+        weights[i]->quantize();
+    }
+    precompute_char_lstm();     // char-based embeddings of known words with quantized weights
+}
+
+void BiLstmTagger::set_rnn_threads(int n){
+    rnn.set_threads(n);
+}
+
+void BiLstmTagger::set_window(int size, int context, int max_chars){
+    window_size = std::max(0, size);
+    window_context = std::max(0, std::min(context, (window_size - 1) / 2));   // at least one token predicted per window
+    rnn.set_max_chars(std::max(0, max_chars));
+    new_model_id();
+}
+
+void BiLstmTagger::set_prediction_cache(shared_ptr<PredictionCache> cache){
+    this->cache = cache;
+}
+
+void BiLstmTagger::new_model_id(){
+    model_id = ++n_model_ids;
 }
 
 void BiLstmTagger::add_expert_classifier(){
@@ -271,9 +497,29 @@ void BiLstmTagger::add_expert_classifier(){
     }
     layers.push_back(new_classifier);
 
+    int n_params = parameters.size();
     for (int j = 0; j < new_classifier.size(); j++){
         new_classifier[j]->get_params(this->parameters);
+        new_classifier[j]->set_fast_activations(params_.fast_activations);
     }
+    for (int i = n_params; i < parameters.size(); i++){
+        parameters[i]->optimizer = &params_.optimizer;
+    }
+    set_head_tasks();
+    new_model_id();
 }
 
 
+
+void BiLstmTagger::memory_usage(MemoryReport &report){
+    lu.memory_usage(report);
+    for (int i = 0; i < parameters.size(); i++){
+        parameters[i]->memory_usage(report);
+    }
+    rnn.memory_usage(report);
+    head.memory_usage(report);
+    if (cache != nullptr){
+        report.add(MemoryReport::PREDICTION_CACHE, cache->bytes());
+    }
+    report.add(MemoryReport::GRAPH, NeuralNode::peak_bytes);
+}
@@ -6,6 +6,7 @@
 
 #include "layers.h"
 #include "neural_encoder.h"
+#include "prediction_cache.h"
 
 
 using std::vector;
@@ -30,6 +31,29 @@ class BiLstmTagger{
 
     vector<NodeMatrix> output_nodes;
 
+    // Output layers of all tasks in one product when there is no hidden layer
+    // (fused_ is set by fprop; the per-task graph in output_nodes is used otherwise)
+    FusedSoftmaxHead head;
+    bool fused_;
+    void set_head_tasks();
+
+    // Identifies the function computed by predict_one: changes with the
+    // parameters and the inference options (key of cached predictions)
+    uint64_t model_id;
+    static std::atomic<uint64_t> n_model_ids;
+    void new_model_id();
+    shared_ptr<PredictionCache> cache;
+    void predict(vector<STRCODE> &X, vector<vector<int>> &Y, int k=0, TopLabels *top=nullptr);
+
+    // Chunked inference (see set_window)
+    int window_size;
+    int window_context;
+    vector<STRCODE> window;
+    // fprop of the window predicting X[begin..end), with context X[first..last)
+    void fprop_window(vector<STRCODE> &X, int begin, int &first, int &end, int &last, bool normalize);
+
+    bool normalized_;       // output layers computed probabilities (set by fprop)
+
 
     // Place holders for computations
 //    vector<vector<Vec*>> t_edata;
@@ -45,14 +69,17 @@ public:
 
     double get_learning_rate();
 
-    void train_one(vector<STRCODE> &X, vector<vector<int>> &Y);
-    void predict_one(vector<STRCODE> &X, vector<vector<int>> &Y);
-    void eval_one(vector<STRCODE> &X, vector<vector<int>> &Y, vector<vector<int>> &predictions, vector<float> &losses);
-    void fprop(vector<STRCODE> &X);
-    void get_losses(vector<float> &losses, vector<vector<int> > &targets);
+    void train_one(vector<STRCODE> &X, const LabelView &Y);
+    void predict_one(vector<STRCODE> &X, vector<vector<int>> &Y);     // argmax only: no softmax
+    // Also returns the k most probable labels of each token and task (not cached)
+    void predict_one(vector<STRCODE> &X, vector<vector<int>> &Y, int k, TopLabels &top);
+    void eval_one(vector<STRCODE> &X, const LabelView &Y, vector<vector<int>> &predictions, vector<float> &losses);
+    void fprop(vector<STRCODE> &X, bool normalize=true);   // normalize: softmax of the output layers (logits otherwise)
+    void get_losses(vector<float> &losses, const LabelView &targets, int begin=0, int end=-1);  // tokens [begin, end) of the graph
     void get_predictions(vector<vector<int>> &predictions);
+    void get_top_labels(int k, TopLabels &top);     // after fprop(X, true)
 
-    void bprop(vector<vector<int>> &targets);
+    void bprop(const LabelView &targets);
     void update(double lr, double T, double clip, bool clipping, bool gaussian, double gaussian_eta);
 
     void assign_parameters(BiLstmTagger *other);
@@ -61,10 +88,37 @@ public:
 
     void average_parameters();
 
+    // Sets parameters to the averaged parameters of other (ASGD).
+    // Cheaper than copy() + average_parameters(): can be called
+    // every epoch on the same (inference only) tagger.
+    void assign_average(BiLstmTagger &other);
+
     void export_model(string &output_dir);
     void import_model(string &output_dir);
 
+    void precompute_char_lstm();
+    void quantize();    // int8 weights for recurrent and output layers (inference only), see quantization.h
+
+    // Threads for the recurrent layers of a single sentence, see BiRnnFeatureExtractor::set_threads
+    void set_rnn_threads(int n);
+
+    // Bounded memory for long inputs (predict_one and eval_one): sentences of
+    // more than size tokens are tagged in windows of at most size tokens, each
+    // predicting its middle tokens with context tokens of context on both sides.
+    // Words are read by the char-based encoder up to max_chars characters.
+    // 0: whole sentences / words (default).
+    void set_window(int size, int context, int max_chars);
+
+    // Predictions of predict_one are looked up in / added to cache (nullptr: no cache).
+    // The cache can be shared by several taggers, entries of different models are distinct.
+    void set_prediction_cache(shared_ptr<PredictionCache> cache);
+
     void add_expert_classifier();
+    bool use_fused_head();      // no hidden layer and weights not quantized
+
+    // Model memory (parameters, gradients, averaging, embeddings, char cache)
+    // and peak computation graph workspace since last call to NeuralNode::reset_peak_bytes()
+    void memory_usage(MemoryReport &report);
 };
 
 
@@ -2,6 +2,13 @@
 
 #include "conll_utils.h"
 
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cctype>
+#include <sstream>
+#include <iomanip>
+
 Pair::Pair(int first, int second){
     this->first = first;
     this->second = second;
@@ -140,17 +147,17 @@ void Output::update_encoder(unordered_map<int, int> &map, int pair_id){
 
 void Output::update_bigrams(ConllTreebank &treebank){
     for (int i = 0; i < treebank.size(); i++){
-        ConllTree *tree = treebank[i];
-        for (int j = 0; j < tree->size(); j++){
+        int size = treebank.sentence_size(i);
+        for (int j = 0; j < size; j++){
             int first = 0;
             if (j > 0){
-                first = (*tree)[j-1]->cpos();
+                first = treebank.cpos(i, j-1);
             }
-            int second = (*tree)[j]->cpos();
+            int second = treebank.cpos(i, j);
 
             int third = 0;
-            if (j + 1 < tree->size()){
-                third = (*tree)[j+1]->cpos();
+            if (j + 1 < size){
+                third = treebank.cpos(i, j+1);
             }
 
             update_encoder(bigrams_left, first + second * BASE);
@@ -180,8 +187,9 @@ int Output::get_code_skipgram(int first, int third){
 }
 
 int Output::get_code(unordered_map<int, int> &map, int pair_id){
-    if (map.find(pair_id) != map.end()){
-        return map[pair_id];
+    auto it = map.find(pair_id);
+    if (it != map.end()){
+        return it->second;
     }
     return 0;
 }
@@ -261,6 +269,10 @@ void ConllToken::print_morphology(ostream &os){
     os << "\t";
 }
 
+void ConllToken::misc(const string &s){
+    _misc = s;
+}
+
 bool ConllToken::has_morpho(){
     for (int i = 0; i < _morpho.size(); i++){
         //cerr << "mm" << _morpho[i] << endl;
@@ -285,6 +297,10 @@ void ConllToken::set_morpho(int type, int val){
     _morpho[type] = val;
 }
 
+const vector<int>& ConllToken::morphology(){
+    return _morpho;
+}
+
 int ConllToken::len_form(){
     return _form.size();
 }
@@ -303,7 +319,7 @@ ostream & operator<<(ostream &os, ConllToken &ct){
     os << "_" << "\t"  // head
        << "_" << "\t"  // rel
        << "_" << "\t"  // phead
-       << "_" << "\t";  // prel
+       << (ct._misc.empty() ? "_" : ct._misc) << "\t";  // prel
     return os;
 }
 
@@ -320,72 +336,6 @@ int ConllTree::size(){
     return tokens.size();
 }
 
-void ConllTree::to_training_example(vector<STRCODE> &X, vector<vector<int>> &Y, Output &output){
-    // This function should probably belong to Output class
-    X.clear();
-    Y.clear();
-
-    for (ConllToken &tok: tokens){
-        X.push_back(tok.form());
-        vector<int> label{tok.cpos()};
-        if (output.xpos){
-            label.push_back(tok.fpos());
-        }
-        if (output.morph){
-            for (int i = 0; i < output.n_feats; i++){
-                label.push_back(tok.get_morpho(i));
-            }
-        }
-        if (output.n_chars){
-            int size = tok.len_form() / 3 + 1;
-            if (size >= output.max_chars / 3 + 1){
-                size = 0;
-            }
-            label.push_back(size);
-        }
-        int second = tok.cpos();
-        int first = 0;
-        if (tok.i() -1 > 0){ // conll id starts at 1
-            first = tokens[tok.i()-2].cpos();
-        }
-        int third = 0;
-        if (tok.i() < tokens.size()){
-            third = tokens[tok.i()].cpos();
-        }
-        if (output.bigram_left){
-            int id = output.get_code_bigram_left(first, second);
-            label.push_back(id);
-        }
-        if (output.bigram_right){
-            int id = output.get_code_bigram_right(second, third);
-            label.push_back(id);
-        }
-        if (output.trigram){
-            int id = output.get_code_trigram(first, second, third);
-            label.push_back(id);
-        }
-        if (output.skipgram){
-            int id = output.get_code_skipgram(first, third);
-            label.push_back(id);
-        }
-        if (output.experts){
-            for (Pair &p : output.expert_classes){
-                int l = 0;
-                if (second == p.first){
-                    l = 1;
-                }
-                if (second == p.second){
-                    l = 2;
-                }
-                label.push_back(l);
-            }
-        }
-        Y.push_back(label);
-    }
-    assert(X.size() > 0);
-    assert(X.size() == Y.size());
-}
-
 void ConllTree::assign_tags(vector<vector<int>> &Y, Output &output){
     for (int i = 0; i < tokens.size(); i++){
         int k = 0;
@@ -406,6 +356,35 @@ void ConllTree::assign_tags(vector<vector<int>> &Y, Output &output){
     }
 }
 
+void ConllTree::assign_top_labels(TopLabels &top, Output &output){
+    auto add = [](std::ostringstream &os, const string &key, const vector<LabelProbability> &labels, std::function<string(int)> name){
+        if (os.tellp() > 0){
+            os << "|";
+        }
+        os << key << "=";
+        for (int r = 0; r < labels.size(); r++){
+            os << (r > 0 ? "," : "") << name(labels[r].label) << ":" << labels[r].probability;
+        }
+    };
+    for (int i = 0; i < tokens.size(); i++){
+        std::ostringstream os;
+        os << std::setprecision(3);
+        int k = 0;
+        add(os, "TopUPOS", top[i][k++], [](int y){ return enc::hodor.decode_to_str(y, enc::UPOS); });
+        if (output.xpos){
+            add(os, "TopXPOS", top[i][k++], [](int y){ return enc::hodor.decode_to_str(y, enc::XPOS); });
+        }
+        if (output.morph){
+            for (int j = 0; j < enc::morph.size(); j++){
+                add(os, "Top" + enc::morph.get_header(j), top[i][k++], [j](int y){
+                    return y == enc::UNDEF || y == enc::UNKNOWN ? string("_") : enc::morph.decode_to_str(y, j);
+                });
+            }
+        }
+        tokens[i].misc(os.str());
+    }
+}
+
 ostream & operator<<(ostream &os, ConllTree &ct){
     for (ConllToken & c: ct.tokens){
         os << c << endl;
@@ -428,39 +407,191 @@ void str_to_conlltokens(vector<String> &tokens, vector<ConllToken> &ctokens){
 }
 
 
-ConllTreebank::ConllTreebank(){}
+ConllTreebank::ConllTreebank() : offsets{0}, morph_offsets{0}, label_columns(0), label_output(nullptr){}
+
 void ConllTreebank::add_tree(ConllTree &tree){
-    trees.push_back(tree);
+    for (int i = 0; i < tree.size(); i++){
+        ConllToken *tok = tree[i];
+        add_token(tok->i(), tok->form(), tok->cpos(), tok->fpos(), tok->morphology());
+    }
+    end_sentence();
+}
+
+void ConllTreebank::add_token(int id, STRCODE form, int cpos, int fpos, const vector<int> &morpho){
+    label_output = nullptr;     // labels are outdated
+    ids.push_back(id);
+    forms.push_back(form);
+    upos.push_back(cpos);
+    xpos.push_back(fpos);
+    for (int type = 0; type < morpho.size(); type++){
+        if (morpho[type] != enc::UNDEF){
+            assert(type <= UINT16_MAX && morpho[type] <= UINT16_MAX);
+            morph.push_back(MorphFeature{uint16_t(type), uint16_t(morpho[type])});
+        }
+    }
+    morph_offsets.push_back(morph.size());
 }
-ConllTree* ConllTreebank::operator[](int i){
-    return &trees[i];
+
+void ConllTreebank::end_sentence(){
+    if (forms.size() > offsets.back()){
+        order.push_back(offsets.size() - 1);
+        offsets.push_back(forms.size());
+    }
 }
+
+int ConllTreebank::token_index(int i, int j){
+    assert(i >= 0 && i < order.size());
+    assert(j >= 0 && j < sentence_size(i));
+    return offsets[order[i]] + j;
+}
+
 int ConllTreebank::size(){
-    return trees.size();
+    return order.size();
 }
 
-void ConllTreebank::update_vocsize_and_frequencies(){
-    assert(frequencies.size() == 0);
-    for (ConllTree &tree : trees){
-        for (int i = 0; i < tree.size(); i++){
-            ConllToken *token = tree[i];
-            int form = token->form();
-            if (frequencies.find(form) != frequencies.end()){
-                frequencies[form] += 1;
-            }else{
-                frequencies[form] = 1;
+int ConllTreebank::sentence_size(int i){
+    return offsets[order[i] + 1] - offsets[order[i]];
+}
+
+int ConllTreebank::n_tokens(){
+    return forms.size();
+}
+
+STRCODE ConllTreebank::form(int i, int j){
+    return forms[token_index(i, j)];
+}
+
+int ConllTreebank::cpos(int i, int j){
+    return upos[token_index(i, j)];
+}
+
+int ConllTreebank::fpos(int i, int j){
+    return xpos[token_index(i, j)];
+}
+
+ConllTree ConllTreebank::tree(int i){
+    vector<ConllToken> tokens;
+    for (int j = 0; j < sentence_size(i); j++){
+        int t = token_index(i, j);
+        vector<int> morpho;
+        for (int m = morph_offsets[t]; m < morph_offsets[t+1]; m++){
+            if (morph[m].type >= morpho.size()){
+                morpho.resize(morph[m].type + 1, enc::UNDEF);
             }
+            morpho[morph[m].type] = morph[m].value;
         }
+        tokens.push_back(ConllToken(ids[t], enc::hodor.decode(forms[t], enc::TOK), forms[t], upos[t], xpos[t], morpho));
+    }
+    return ConllTree(tokens);
+}
+
+void ConllTreebank::compute_labels(Output &output){
+    // This function should probably belong to Output class
+    assert(output.n_labels.size() > 0);
+    label_columns = output.n_labels.size();
+    label_output = &output;
+    labels.clear();
+    labels.reserve(forms.size() * label_columns);
+
+    for (int s = 0; s + 1 < offsets.size(); s++){
+        int begin = offsets[s];
+        int end = offsets[s+1];
+        for (int t = begin; t < end; t++){
+            labels.push_back(upos[t]);
+            if (output.xpos){
+                labels.push_back(xpos[t]);
+            }
+            if (output.morph){
+                int k = labels.size();
+                labels.resize(k + output.n_feats, enc::UNDEF);
+                for (int m = morph_offsets[t]; m < morph_offsets[t+1]; m++){
+                    if (morph[m].type < output.n_feats){
+                        labels[k + morph[m].type] = morph[m].value;
+                    }
+                }
+            }
+            if (output.n_chars){
+                int size = enc::hodor.length(forms[t], enc::TOK) / 3 + 1;
+                if (size >= output.max_chars / 3 + 1){
+                    size = 0;
+                }
+                labels.push_back(size);
+            }
+            int second = upos[t];
+            int first = 0;
+            if (t > begin){
+                first = upos[t-1];
+            }
+            int third = 0;
+            if (t + 1 < end){
+                third = upos[t+1];
+            }
+            if (output.bigram_left){
+                labels.push_back(output.get_code_bigram_left(first, second));
+            }
+            if (output.bigram_right){
+                labels.push_back(output.get_code_bigram_right(second, third));
+            }
+            if (output.trigram){
+                labels.push_back(output.get_code_trigram(first, second, third));
+            }
+            if (output.skipgram){
+                labels.push_back(output.get_code_skipgram(first, third));
+            }
+            if (output.experts){
+                for (Pair &p : output.expert_classes){
+                    int l = 0;
+                    if (second == p.first){
+                        l = 1;
+                    }
+                    if (second == p.second){
+                        l = 2;
+                    }
+                    labels.push_back(l);
+                }
+            }
+            assert(labels.size() == (t + 1) * label_columns);
+        }
+    }
+}
+
+void ConllTreebank::to_training_example(int i, vector<STRCODE> &X, LabelView &Y, Output &output){
+    if (label_output != &output || label_columns != output.n_labels.size()){
+        compute_labels(output);
+    }
+    int begin = offsets[order[i]];
+    int end = offsets[order[i] + 1];
+    X.assign(forms.begin() + begin, forms.begin() + end);
+    Y = LabelView(labels.data() + begin * label_columns, end - begin, label_columns);
+    assert(X.size() > 0);
+}
+
+void ConllTreebank::update_vocsize_and_frequencies(){
+    assert(frequencies.size() == 0);
+    for (STRCODE form : forms){
+        frequencies[form] += 1;
     }
 }
 
 void ConllTreebank::shuffle(){
-    std::shuffle(trees.begin(), trees.end(), rd::Random::re);
+    std::shuffle(order.begin(), order.end(), rd::Random::re);
 }
 
 void ConllTreebank::subset(ConllTreebank &other, int n){
+    vector<int> morpho;
     for (int i = 0; i < n; i++){
-        other.add_tree(trees[i]);
+        for (int j = 0; j < sentence_size(i); j++){
+            int t = token_index(i, j);
+            morpho.clear();
+            for (int m = morph_offsets[t]; m < morph_offsets[t+1]; m++){
+                if (morph[m].type >= morpho.size()){
+                    morpho.resize(morph[m].type + 1, enc::UNDEF);
+                }
+                morpho[morph[m].type] = morph[m].value;
+            }
+            other.add_token(ids[t], forms[t], upos[t], xpos[t], morpho);
+        }
+        other.end_sentence();
     }
 }
 
@@ -468,9 +599,84 @@ unordered_map<int, int>* ConllTreebank::get_frequencies_dict(){
     return &frequencies;
 }
 
+void ConllTreebank::write_binary(ostream &os){
+    ::write_binary(os, int32_t(order.size()));
+    ::write_binary(os, int32_t(forms.size()));
+    ::write_binary(os, int32_t(morph.size()));
+    ::write_binary(os, order.data(), order.size());
+    ::write_binary(os, offsets.data(), offsets.size());
+    ::write_binary(os, ids.data(), ids.size());
+    ::write_binary(os, forms.data(), forms.size());
+    ::write_binary(os, upos.data(), upos.size());
+    ::write_binary(os, xpos.data(), xpos.size());
+    ::write_binary(os, morph_offsets.data(), morph_offsets.size());
+    ::write_binary(os, morph.data(), morph.size());
+}
+
+namespace {
+template<typename T>
+bool read_column(BinaryReader &in, vector<T> &column, int n){
+    const T *data = in.read_array<T>(n);
+    if (data == nullptr){
+        return false;
+    }
+    column.assign(data, data + n);
+    return true;
+}
+
+// Offsets must be increasing from 0 to size
+bool valid_offsets(vector<int> &offsets, int size){
+    if (offsets.front() != 0 || offsets.back() != size){
+        return false;
+    }
+    for (int i = 1; i < offsets.size(); i++){
+        if (offsets[i] < offsets[i-1]){
+            return false;
+        }
+    }
+    return true;
+}
+}
+
+bool ConllTreebank::read_binary(BinaryReader &in){
+    int32_t n_sentences = in.read<int32_t>();
+    int32_t n_tokens = in.read<int32_t>();
+    int32_t n_morph = in.read<int32_t>();
+    if (in.fail || n_sentences < 0 || n_tokens < 0 || n_morph < 0){
+        return false;
+    }
+    label_output = nullptr;
+    if (! (read_column(in, order, n_sentences)
+           && read_column(in, offsets, n_sentences + 1)
+           && read_column(in, ids, n_tokens)
+           && read_column(in, forms, n_tokens)
+           && read_column(in, upos, n_tokens)
+           && read_column(in, xpos, n_tokens)
+           && read_column(in, morph_offsets, n_tokens + 1)
+           && read_column(in, morph, n_morph))){
+        return false;
+    }
+    if (! valid_offsets(offsets, n_tokens) || ! valid_offsets(morph_offsets, n_morph)){
+        return false;
+    }
+    for (int s : order){
+        if (s < 0 || s >= n_sentences){
+            return false;
+        }
+    }
+    int vocsize = enc::hodor.size(enc::TOK);
+    for (STRCODE form : forms){
+        if (form >= vocsize){
+            return false;
+        }
+    }
+    return true;
+}
+
 ostream & operator<<(ostream &os, ConllTreebank &ct){
-    for (ConllTree & c: ct.trees){
-        os << c << endl;
+    for (int i = 0; i < ct.size(); i++){
+        ConllTree tree = ct.tree(i);
+        os << tree << endl;
     }
     return os;
 }
@@ -512,30 +718,24 @@ void parse_morphology(String &s, vector<int> &morph, bool train){
     }
 }
 
-void read_conll_corpus(std::string &filename,
-                       ConllTreebank &treebank,
-                       bool train){
+namespace {
 
-    string type("word");
-    enc::hodor.find_type_id(type, true);
-    type = "tag";
-    enc::hodor.find_type_id(type, true);
-    type = "upos";
-    enc::hodor.find_type_id(type, true);
-    type = "xpos";
-    enc::hodor.find_type_id(type, true);
+// Lines with missing fields are skipped (a token cannot be built from them)
+void warn_malformed_line(const string &filename, int line_number, int n_fields){
+    cerr << "Warning: " << filename << ":" << line_number << ": " << n_fields
+         << " fields instead of " << ConllU::MISC + 1 << ", line skipped" << endl;
+}
 
+// Line by line reader (input that cannot be memory mapped, e.g. a pipe)
+void read_conll_stream(const string &filename, ConllTreebank &treebank, bool train){
     ifstream in(filename);
     string buffer;
-    vector<ConllToken> tokens;
 
+    int line_number = 0;
     while (getline(in, buffer)){
+        line_number++;
         if (buffer.size() == 0){
-            if (tokens.size() > 0){
-                ConllTree tree(tokens);
-                treebank.add_tree(tree);
-                tokens.clear();
-            }
+            treebank.end_sentence();
             continue;
         }
         if (buffer[0] == '#'){
@@ -544,7 +744,10 @@ void read_conll_corpus(std::string &filename,
         wstring wbuffer = str::decode(buffer);
         vector<wstring> split_tokens;
         str::split(wbuffer, "\t", "", split_tokens);
-        assert(split_tokens.size() == 10);
+        if (split_tokens.size() < ConllU::MISC + 1){
+            warn_malformed_line(filename, line_number, split_tokens.size());
+            continue;
+        }
 
         if (split_tokens[0].find(L"-") != std::string::npos){
             continue;
@@ -560,8 +763,215 @@ void read_conll_corpus(std::string &filename,
         vector<int> morpho;
         parse_morphology(split_tokens[ConllU::FEATS], morpho, train);
 
-        ConllToken tok(id, form, iform, cpos, fpos, morpho);
-        tokens.push_back(tok);
+        treebank.add_token(id, iform, cpos, fpos, morpho);
     }
+    treebank.end_sentence();
     in.close();
 }
+
+// A field of a line: bytes [begin, end)
+struct Field{
+    const char *begin;
+    const char *end;
+};
+
+// Tab separated fields of a line, empty fields are skipped (as str::split).
+// Returns the number of fields, only the first max_fields are stored.
+int split_fields(const char *begin, const char *end, Field *fields, int max_fields){
+    int n = 0;
+    while (begin < end){
+        const char *tab = static_cast<const char*>(memchr(begin, '\t', end - begin));
+        if (tab == nullptr){
+            tab = end;
+        }
+        if (tab > begin){
+            if (n < max_fields){
+                fields[n] = Field{begin, tab};
+            }
+            n++;
+        }
+        begin = tab + 1;
+    }
+    return n;
+}
+
+// Integer at the beginning of a field (as stoi)
+int parse_id(const Field &f){
+    const char *c = f.begin;
+    while (c < f.end && isspace(*c)){
+        c++;
+    }
+    bool negative = c < f.end && *c == '-';
+    if (c < f.end && (*c == '-' || *c == '+')){
+        c++;
+    }
+    assert(c < f.end && *c >= '0' && *c <= '9');
+    int v = 0;
+    for (; c < f.end && *c >= '0' && *c <= '9'; c++){
+        v = 10 * v + (*c - '0');
+    }
+    return negative ? -v : v;
+}
+
+// Value of the bytes of a field, computed from the field once per read
+template<typename T, typename F>
+const T& lookup(unordered_map<string, T> &map, string &key, const Field &f, F compute){
+    key.assign(f.begin, f.end);
+    auto it = map.find(key);
+    if (it == map.end()){
+        it = map.emplace(key, compute()).first;
+    }
+    return it->second;
+}
+}
+
+void read_conll_corpus(std::string &filename,
+                       ConllTreebank &treebank,
+                       bool train){
+
+    string type("word");
+    enc::hodor.find_type_id(type, true);
+    type = "tag";
+    enc::hodor.find_type_id(type, true);
+    type = "upos";
+    enc::hodor.find_type_id(type, true);
+    type = "xpos";
+    enc::hodor.find_type_id(type, true);
+
+    MappedFile file(filename);
+    if (! file.is_open()){
+        read_conll_stream(filename, treebank, train);
+        return;
+    }
+
+    // Codes only depend on the field bytes during a read: each distinct
+    // field is decoded and encoded once (the encoders are not modified elsewhere)
+    unordered_map<string, STRCODE> forms;
+    unordered_map<string, STRCODE> upos;
+    unordered_map<string, STRCODE> xpos;
+    unordered_map<string, vector<int>> feats;
+    string key;
+    Field fields[ConllU::MISC + 1];
+
+    const char *line = file.data;
+    const char *end = file.data + file.size;
+    int line_number = 0;
+    while (line < end){
+        const char *eol = static_cast<const char*>(memchr(line, '\n', end - line));
+        if (eol == nullptr){
+            eol = end;
+        }
+        line_number++;
+        if (eol == line){
+            treebank.end_sentence();
+        }else if (*line != '#'){
+            int n_fields = split_fields(line, eol, fields, ConllU::MISC + 1);
+            const Field &id = fields[ConllU::ID];
+            if (n_fields < ConllU::MISC + 1){
+                warn_malformed_line(filename, line_number, n_fields);
+            }else if (memchr(id.begin, '-', id.end - id.begin) == nullptr){
+                STRCODE iform = lookup(forms, key, fields[ConllU::FORM], [&](){ return enc::hodor.code(str::decode(key), enc::TOK); });
+                STRCODE cpos = lookup(upos, key, fields[ConllU::UPOS], [&](){ return enc::hodor.code(str::decode(key), enc::UPOS); });
+                STRCODE fpos = lookup(xpos, key, fields[ConllU::XPOS], [&](){ return enc::hodor.code(str::decode(key), enc::XPOS); });
+                const vector<int> &morpho = lookup(feats, key, fields[ConllU::FEATS], [&](){
+                    String s = str::decode(key);
+                    vector<int> m;
+                    parse_morphology(s, m, train);
+                    return m;
+                });
+                treebank.add_token(parse_id(id), iform, cpos, fpos, morpho);
+            }
+        }
+        line = eol < end ? eol + 1 : end;
+    }
+    treebank.end_sentence();
+}
+
+namespace {
+const char COMPILED_CORPUS_MAGIC[8] = {'M', 'T', 'A', 'G', 'C', 'O', 'R', 'P'};
+const int32_t COMPILED_CORPUS_VERSION = 2;
+
+// Size and modification time of a source file, -1 if it does not exist
+void file_signature(const string &filename, int64_t &size, int64_t &mtime){
+    struct stat sb;
+    if (stat(filename.c_str(), &sb) != 0){
+        size = mtime = -1;
+        return;
+    }
+    size = sb.st_size;
+    mtime = sb.st_mtime;
+}
+}
+
+void write_compiled_corpus(const string &filename,
+                           vector<string> &sources,
+                           vector<ConllTreebank*> &treebanks){
+    // Write to a temporary file and rename: concurrent runs never see a partial file
+    string tmp = filename + ".tmp" + std::to_string(getpid());
+    ofstream os(tmp, std::ios::binary);
+    os.write(COMPILED_CORPUS_MAGIC, sizeof(COMPILED_CORPUS_MAGIC));
+    write_binary(os, COMPILED_CORPUS_VERSION);
+    write_binary(os, int32_t(sources.size()));
+    for (string &source : sources){
+        int64_t size, mtime;
+        file_signature(source, size, mtime);
+        write_binary(os, size);
+        write_binary(os, mtime);
+    }
+    enc::hodor.write_binary(os);
+    enc::morph.write_binary(os);
+    write_binary(os, int32_t(treebanks.size()));
+    for (ConllTreebank *tbk : treebanks){
+        tbk->write_binary(os);
+    }
+    os.close();
+    if (! os || rename(tmp.c_str(), filename.c_str()) != 0){
+        cerr << "Warning: could not write compiled corpus " << filename << endl;
+        remove(tmp.c_str());
+    }
+}
+
+bool read_compiled_corpus(const string &filename,
+                          vector<string> &sources,
+                          vector<ConllTreebank*> &treebanks){
+    MappedFile file(filename);
+    if (! file.is_open()){
+        return false;
+    }
+    BinaryReader in(file.data, file.size);
+    const char *magic = in.read_array<char>(sizeof(COMPILED_CORPUS_MAGIC));
+    if (magic == nullptr
+            || memcmp(magic, COMPILED_CORPUS_MAGIC, sizeof(COMPILED_CORPUS_MAGIC)) != 0
+            || in.read<int32_t>() != COMPILED_CORPUS_VERSION
+            || in.read<int32_t>() != sources.size()){
+        return false;
+    }
+    for (string &source : sources){
+        int64_t size, mtime;
+        file_signature(source, size, mtime);
+        if (in.read<int64_t>() != size || in.read<int64_t>() != mtime){
+            return false;
+        }
+    }
+
+    // Decode into temporaries: encoders and treebanks are only modified on success
+    enc::TypedStrEncoder hodor, morph;
+    hodor.read_binary(in);
+    morph.read_binary(in);
+    if (in.fail || in.read<int32_t>() != treebanks.size()){
+        return false;
+    }
+    std::swap(hodor, enc::hodor);   // ConllTreebank::read_binary checks forms against enc::hodor
+    vector<ConllTreebank> loaded(treebanks.size());
+    for (ConllTreebank &tbk : loaded){
+        if (! tbk.read_binary(in)){
+            std::swap(hodor, enc::hodor);
+            return false;
+        }
+    }
+    std::swap(morph, enc::morph);
+    for (int i = 0; i < treebanks.size(); i++){
+        std::swap(*treebanks[i], loaded[i]);
+    }
+    return true;
+}
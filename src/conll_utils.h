@@ -96,6 +96,8 @@ class ConllToken{
 
     vector<int> _morpho;
 
+    string _misc;
+
 public:
     //ConllToken(int position, String _form, int _iform);
     ConllToken(int position, String _form, int _iform, int _cpos, int _fpos, vector<int> morpho);
@@ -112,6 +114,9 @@ public:
     bool has_morpho();
     int get_morpho(int type);
     void set_morpho(int type, int val);
+    const vector<int>& morphology();
+
+    void misc(const string &s);     // MISC column (printed as _ if empty)
 
     int len_form();
 
@@ -126,24 +131,68 @@ public:
     ConllToken* operator[](int i);
     int size();
 
-    void to_training_example(vector<STRCODE> &X, vector<vector<int>> &Y, Output &output);
-
     void assign_tags(vector<vector<int>> &Y, Output &output);
+    // MISC: TopUPOS=NOUN:0.91,PROPN:0.05|TopXPOS=...|TopGender=Masc:0.8,_:0.2 (_: feature not set)
+    void assign_top_labels(TopLabels &top, Output &output);
 
     friend ostream & operator<<(ostream &os, ConllTree &ct);
 };
 
 void str_to_conlltokens(vector<String> &tokens, vector<ConllToken> &ctokens);
 
+// Morphological feature of a token (type and value codes from enc::morph)
+struct MorphFeature{
+    uint16_t type;
+    uint16_t value;
+};
+
+// Columnar storage: token fields are stored in contiguous arrays
+// indexed by sentence offsets, word forms are only stored as codes
+// (strings are decoded with enc::hodor when needed). Sentences are
+// accessed through a permutation (shuffle() only permutes indexes).
 class ConllTreebank{
-    vector<ConllTree> trees;
+    vector<int> order;              // sentence i is stored sentence order[i]
+    vector<int> offsets;            // tokens of stored sentence s: [offsets[s], offsets[s+1])
+    vector<int> ids;
+    vector<STRCODE> forms;
+    vector<int> upos;
+    vector<int> xpos;
+    vector<int> morph_offsets;      // features of token t: [morph_offsets[t], morph_offsets[t+1])
+    vector<MorphFeature> morph;     // only defined features
+
+    vector<int> labels;             // n_tokens x label_columns, see compute_labels
+    int label_columns;
+    const Output *label_output;
+
     //vector<int> voc_sizes;
     unordered_map<int, int> frequencies;
+
+    int token_index(int i, int j);
 public:
     ConllTreebank();
     void add_tree(ConllTree &tree);
-    ConllTree* operator[](int i);
+    void add_token(int id, STRCODE form, int cpos, int fpos, const vector<int> &morpho);
+    void end_sentence();
     int size();
+    int sentence_size(int i);
+    int n_tokens();
+
+    // Token j of sentence i
+    STRCODE form(int i, int j);
+    int cpos(int i, int j);
+    int fpos(int i, int j);
+
+    // Copy of sentence i as a tree (e.g. to assign predicted tags and print it)
+    ConllTree tree(int i);
+
+    // Precomputes the labels of every token for output (one column per task).
+    // Must be called again when output changes (e.g. new expert classifier)
+    // before using the treebank from several threads.
+    void compute_labels(Output &output);
+
+    // X: copy of the word codes (no allocation once X is large enough),
+    // Y: view of the precomputed labels (computed here if missing or outdated)
+    void to_training_example(int i, vector<STRCODE> &X, LabelView &Y, Output &output);
 
     void update_vocsize_and_frequencies();
 
@@ -153,15 +202,35 @@ public:
 
     unordered_map<int, int>* get_frequencies_dict();
 
+    // Flat arrays: sentence offsets, token fields and morphology codes
+    void write_binary(ostream &os);
+    bool read_binary(BinaryReader &in);
+
     friend ostream & operator<<(ostream &os, ConllTreebank &ct);
 };
 
 void parse_morphology(String &s, vector<int> &morph, bool train);
 
+// Memory maps the file (line by line reading if it cannot be mapped, e.g. a pipe).
+// Comment lines and multiword tokens are skipped.
 void read_conll_corpus(std::string &filename,
                        ConllTreebank &treebank,
                        bool train);
 
+// Compiled corpus: treebanks read from the CoNLL-U files 'sources'
+// and the resulting state of enc::hodor and enc::morph, in a single
+// memory mapped binary file. Repeated training runs skip parsing and
+// encoding. The file records the size and modification time of each
+// source: read_compiled_corpus fails (returns false, leaves treebanks
+// and encoders untouched) if the file is missing, corrupted or stale.
+void write_compiled_corpus(const string &filename,
+                           vector<string> &sources,
+                           vector<ConllTreebank*> &treebanks);
+
+bool read_compiled_corpus(const string &filename,
+                          vector<string> &sources,
+                          vector<ConllTreebank*> &treebanks);
+
 
 
 #endif // CONLL_UTILS_H
@@ -1,4 +1,5 @@
 #include "layers.h"
+#include "activations.h"
 
 Mat xavier(int insize, int outsize){
     return Mat::Random(outsize, insize) * sqrt(6.0 / (outsize + insize));
@@ -8,8 +9,125 @@ double rectifier(double x){
     return x;
 }
 
+double noise_sigma(double T, double gaussian_eta){
+    return pow(gaussian_eta / pow(1.0 + T, 0.55), 0.5);
+}
+
+void sgd_step(double *w, double *g, double *c, int n, double lr, double T, bool avg, double clip, double sigma){
+    // The averaged parameter is w - c / T (see average()).
+    double lrT = avg ? lr * T : 0.0;
+    if (sigma == 0.0 && clip == 0.0){
+        // Entries whose gradient is zero (e.g. labels masked by SoftmaxFilter) are only read:
+        // they contribute nothing to c until they are actually updated.
+        for (int i = 0; i < n; i++){
+            double gi = g[i];
+            if (gi != 0.0){
+                w[i] -= lr * gi;
+                c[i] -= lrT * gi;
+                g[i] = 0.0;
+            }
+        }
+        return;
+    }
+    // Noise and clipping: single pass over blocks small enough for noise to stay in cache
+    const int BLOCK = 256;
+    double noise[BLOCK];
+    std::fill(noise, noise + BLOCK, 0.0);
+    rd::Xoshiro256 &generator = rd::thread_generator();
+    double lo = clip > 0.0 ? -clip : -std::numeric_limits<double>::infinity();
+    double hi = clip > 0.0 ? clip : std::numeric_limits<double>::infinity();
+    for (int start = 0; start < n; start += BLOCK){
+        int m = std::min(BLOCK, n - start);
+        if (sigma > 0.0){
+            generator.normal(noise, m, sigma);
+        }
+        double *wb = w + start;
+        double *gb = g + start;
+        double *cb = c + start;
+        for (int i = 0; i < m; i++){
+            double gi = std::min(hi, std::max(lo, gb[i] + noise[i]));
+            wb[i] -= lr * gi;
+            cb[i] -= lrT * gi;
+            gb[i] = 0.0;
+        }
+    }
+}
+
+Optimizer::Optimizer():type(SGD), beta1(0.9), beta2(0.999), epsilon(1e-8){}
+
+int Optimizer::n_moments() const{
+    switch (type){
+    case ADAGRAD: return 1;
+    case ADAM:    return 2;
+    default:      return 0;
+    }
+}
+
+void adaptive_step(const Optimizer &optimizer, double *w, double *g, double *c, double *m1, double *m2, int n,
+                   double lr, double t, bool avg, double clip, double sigma){
+    const int BLOCK = 256;
+    double noise[BLOCK];
+    std::fill(noise, noise + BLOCK, 0.0);
+    rd::Xoshiro256 &generator = rd::thread_generator();
+    double lo = clip > 0.0 ? -clip : -std::numeric_limits<double>::infinity();
+    double hi = clip > 0.0 ? clip : std::numeric_limits<double>::infinity();
+    double T = avg ? t - 1 : 0.0;   // ASGD: c -= T * delta
+    double b1 = optimizer.beta1;
+    double b2 = optimizer.beta2;
+    double eps = optimizer.epsilon;
+    double lr1 = lr / (1.0 - pow(b1, t));           // Adam bias corrections
+    double corr2 = 1.0 / (1.0 - pow(b2, t));
+    for (int start = 0; start < n; start += BLOCK){
+        int m = std::min(BLOCK, n - start);
+        if (sigma > 0.0){
+            generator.normal(noise, m, sigma);
+        }
+        double *wb = w + start;
+        double *gb = g + start;
+        double *cb = c + start;
+        double *m1b = m1 + start;
+        if (optimizer.type == Optimizer::ADAGRAD){
+            for (int i = 0; i < m; i++){
+                double gi = std::min(hi, std::max(lo, gb[i] + noise[i]));
+                m1b[i] += gi * gi;
+                double delta = lr * gi / (sqrt(m1b[i]) + eps);
+                wb[i] -= delta;
+                cb[i] -= T * delta;
+                gb[i] = 0.0;
+            }
+        }else{
+            double *m2b = m2 + start;
+            for (int i = 0; i < m; i++){
+                double gi = std::min(hi, std::max(lo, gb[i] + noise[i]));
+                m1b[i] = b1 * m1b[i] + (1.0 - b1) * gi;
+                m2b[i] = b2 * m2b[i] + (1.0 - b2) * gi * gi;
+                double delta = lr1 * m1b[i] / (sqrt(m2b[i] * corr2) + eps);
+                wb[i] -= delta;
+                cb[i] -= T * delta;
+                gb[i] = 0.0;
+            }
+        }
+    }
+}
+
 Parameter::Parameter(){
     avg = true;
+    optimizer = nullptr;
+    m1 = m2 = nullptr;
+}
+
+void Parameter::step(double *w, double *g, double *c, int n, double lr, double T, double clip, bool clipping, bool gaussian, double gaussian_eta){
+    double sigma = gaussian ? noise_sigma(T, gaussian_eta) : 0.0;
+    if (optimizer == nullptr || optimizer->type == Optimizer::SGD){
+        sgd_step(w, g, c, n, lr, T, avg, clipping ? clip : 0.0, sigma);
+        return;
+    }
+    if (m1 == nullptr){
+        moments = Eigen::ArrayXd::Zero(n * optimizer->n_moments());
+        m1 = moments.data();
+        m2 = optimizer->n_moments() > 1 ? m1 + n : nullptr;
+    }
+    adaptive_step(*optimizer, w, g, c, m1, m2, n, lr, T + 1, avg, clipping ? clip : 0.0, sigma);
 }
 
 Parameter::~Parameter(){}
@@ -18,8 +136,39 @@ Parameter::~Parameter(){}
 
 
 
+bool RunMode::inference_only = false;
+bool RunMode::input_projection = true;
+
+const string MemoryReport::names[MemoryReport::N_COMPONENTS] = {
+    "parameters", "gradients", "averaging", "optimizer state", "embeddings", "encoders", "char cache", "prediction cache", "graph workspace (peak)"};
+
+MemoryReport::MemoryReport():bytes(N_COMPONENTS, 0){}
+
+void MemoryReport::add(int component, size_t b){
+    bytes[component] += b;
+}
+
+size_t MemoryReport::total(){
+    size_t t = 0;
+    for (size_t b : bytes){
+        t += b;
+    }
+    return t;
+}
+
+void MemoryReport::print(ostream &os){
+    os << "Memory usage:" << endl;
+    for (int i = 0; i < N_COMPONENTS; i++){
+        os << "  " << names[i] << string(24 - names[i].size(), ' ') << bytes[i] / (1024.0 * 1024.0) << " MB" << endl;
+    }
+    os << "  total" << string(19, ' ') << total() / (1024.0 * 1024.0) << " MB" << endl;
+}
+
+
+void Parameter::quantize(){}
+
 void Parameter::export_model(const string &outfile){
-    ofstream os(outfile);
+    ofstream os(outfile, std::ios::binary);
     print(os);
     os.close();
 }
@@ -27,27 +176,17 @@ void Parameter::export_model(const string &outfile){
 
 
 
-MatParam::MatParam(Mat *w1, Mat *w2, Mat *w3){
+MatParam::MatParam(Mat *w1, Mat *w2, Mat *w3, QMat *q){
     w = w1;
     dw = w2;
     cw = w3;
+    this->q = q;
 }
 
 MatParam::~MatParam(){}
 
 void MatParam::update(double lr, double T, double clip, bool clipping, bool gaussian, double gaussian_eta){
-    if (gaussian){
-        double sigma = pow(gaussian_eta / pow(1.0 + T, 0.55), 0.5);
-        std::normal_distribution<double> distribution(0.0, sigma);
-        //dw->array() = dw->unaryExpr([&distribution](double x) -> double { return x + distribution(random); });
-        dw->array() = dw->unaryExpr([&distribution](double x) -> double { return x + distribution(rd::Random::re); });
-    }
-    if (clipping){
-        dw->array() = dw->unaryExpr([clip](double x) -> double { if (x > clip) return clip; if (x < -clip) return -clip; return x; });
-    }
-    *w -= lr * (*dw);
-    if (avg){ *cw -= lr * T * (*dw); }
-    (*dw).fill(0.0);
+    step(w->data(), dw->data(), cw->data(), w->size(), lr, T, clip, clipping, gaussian, gaussian_eta);
 }
 
 void MatParam::average(double T){
@@ -81,12 +220,36 @@ void MatParam::assign(shared_ptr<Parameter> &other){
     *cw = *(p->cw);
 }
 
+void MatParam::assign_average(shared_ptr<Parameter> &other, double T){
+    shared_ptr<MatParam> p = std::static_pointer_cast<MatParam>(other);
+    *w = *(p->w) - *(p->cw) / T;
+}
+
 void MatParam::print(ostream &os){
-    os << *w << endl;
+    if (q != nullptr && ! q->empty()){
+        q->write_binary(os);
+    }else{
+        os << *w << endl;
+    }
 }
 
 
 void MatParam::load(const string &file){
+    {
+        MappedFile mf(file);
+        if (mf.is_open() && mf.size >= sizeof(QMat::MAGIC)
+                && memcmp(mf.data, QMat::MAGIC, sizeof(QMat::MAGIC)) == 0){
+            assert(q != nullptr && "Quantized weights for a layer without int8 path");
+            BinaryReader in(mf.data, mf.size);
+            q->read_binary(in);
+            if (in.fail || q->rows != w->rows() || q->cols != w->cols()){
+                cerr << "Error: corrupted quantized parameter file " << file << endl;
+                exit(1);
+            }
+            *w = Mat();
+            return;
+        }
+    }
     Mat m;
     load_matrix<Mat>(file, m);
     assert(w->size() == m.size() && w->cols() == m.cols());
@@ -105,6 +268,23 @@ double MatParam::gradient_squared_norm(){
     return dw->squaredNorm();
 }
 
+void MatParam::quantize(){
+    if (q != nullptr){
+        q->quantize(*w);
+        *w = Mat();
+    }
+}
+
+void MatParam::memory_usage(MemoryReport &report){
+    report.add(MemoryReport::PARAMETERS, sizeof(Mat) + w->size() * sizeof(double));
+    if (q != nullptr && ! q->empty()){
+        report.add(MemoryReport::PARAMETERS, q->memory_usage());
+    }
+    report.add(MemoryReport::GRADIENTS, sizeof(Mat) + dw->size() * sizeof(double));
+    report.add(MemoryReport::AVERAGING, sizeof(Mat) + cw->size() * sizeof(double));
+    report.add(MemoryReport::OPTIMIZER, moments.size() * sizeof(double));
+}
+
 /////////////////////////////////////////////////////////////////
 ///
 ///
@@ -131,17 +311,7 @@ VecParam::VecParam(Vec *b1, Vec *b2, Vec *b3){
 VecParam::~VecParam(){}
 
 void VecParam::update(double lr, double T, double clip, bool clipping, bool gaussian, double gaussian_eta){
-    if (gaussian){
-        double sigma = pow(gaussian_eta / pow(1.0 + T, 0.55), 0.5);
-        std::normal_distribution<double> distribution(0.0, sigma);
-        db->array() = db->unaryExpr([&distribution](double x) -> double { return x + distribution(rd::Random::re); });
-    }
-    if (clipping){
-        db->array() = db->unaryExpr([clip](double x) -> double { if (x > clip) return clip; if (x < -clip) return -clip; return x; });
-    }
-    *b -= lr * (*db);
-    if (avg){ *cb -= lr * T * (*db); }
-    (*db).fill(0.0);
+    step(b->data(), db->data(), cb->data(), b->size(), lr, T, clip, clipping, gaussian, gaussian_eta);
 }
 
 void VecParam::average(double T){
@@ -175,6 +345,11 @@ void VecParam::assign(shared_ptr<Parameter> &other){
     *cb = *(p->cb);
 }
 
+void VecParam::assign_average(shared_ptr<Parameter> &other, double T){
+    shared_ptr<VecParam> p = std::static_pointer_cast<VecParam>(other);
+    *b = *(p->b) - *(p->cb) / T;
+}
+
 void VecParam::print(ostream &os){
     os << *b << endl;
 }
@@ -199,6 +374,13 @@ double VecParam::gradient_squared_norm(){
     return db->squaredNorm();
 }
 
+void VecParam::memory_usage(MemoryReport &report){
+    report.add(MemoryReport::PARAMETERS, sizeof(Vec) + b->size() * sizeof(double));
+    report.add(MemoryReport::GRADIENTS, sizeof(Vec) + db->size() * sizeof(double));
+    report.add(MemoryReport::AVERAGING, sizeof(Vec) + cb->size() * sizeof(double));
+    report.add(MemoryReport::OPTIMIZER, moments.size() * sizeof(double));
+}
+
 
 
 
@@ -208,26 +390,96 @@ double VecParam::gradient_squared_norm(){
 Layer::~Layer(){}
 
 void Layer::get_params(vector<shared_ptr<Parameter>> &t){}
+void Layer::set_fast_activations(bool fast){}
+
+
+namespace {
+
+template <int R, int C>
+struct FixedLinearKernel{
+    typedef Eigen::Matrix<double, R, C> M;
+    typedef Eigen::Matrix<double, R, 1> VR;
+    typedef Eigen::Matrix<double, C, 1> VC;
+
+    static void fprop(const Mat &w, const Vec &x, Vec &y){
+        y.resize(w.rows());
+        Eigen::Map<VR>(y.data(), w.rows()).noalias() =
+                Eigen::Map<const M>(w.data(), w.rows(), w.cols()) * Eigen::Map<const VC>(x.data(), x.size());
+    }
+    static void fprop_add(const Mat &w, const Vec &x, Vec &y){
+        Eigen::Map<VR>(y.data(), y.size()).noalias() +=
+                Eigen::Map<const M>(w.data(), w.rows(), w.cols()) * Eigen::Map<const VC>(x.data(), x.size());
+    }
+    static void bprop(const Mat &w, Mat &dw, const Vec &x, const Vec &dy, Vec &dx){
+        Eigen::Map<const VR> mdy(dy.data(), dy.size());
+        Eigen::Map<M>(dw.data(), dw.rows(), dw.cols()).noalias() += mdy * Eigen::Map<const VC>(x.data(), x.size()).transpose();
+        Eigen::Map<VC>(dx.data(), dx.size()).noalias() += Eigen::Map<const M>(w.data(), w.rows(), w.cols()).transpose() * mdy;
+    }
+
+    static const LinearKernel kernel;
+};
+
+template <int R, int C>
+const LinearKernel FixedLinearKernel<R, C>::kernel = {
+    &FixedLinearKernel<R, C>::fprop,
+    &FixedLinearKernel<R, C>::fprop_add,
+    &FixedLinearKernel<R, C>::bprop
+};
+
+template <int R>
+const LinearKernel* kernel_rows(int cols){
+    switch (cols){
+    case 16:  return &FixedLinearKernel<R, 16>::kernel;
+    case 32:  return &FixedLinearKernel<R, 32>::kernel;
+    case 64:  return &FixedLinearKernel<R, 64>::kernel;
+    case 128: return &FixedLinearKernel<R, 128>::kernel;
+    case 256: return &FixedLinearKernel<R, 256>::kernel;
+    default:  return &FixedLinearKernel<R, Eigen::Dynamic>::kernel;
+    }
+}
+
+}
+
+const LinearKernel* LinearKernel::get(int rows, int cols){
+    switch (rows){
+    case 16:  return kernel_rows<16>(cols);
+    case 32:  return kernel_rows<32>(cols);
+    case 64:  return kernel_rows<64>(cols);
+    case 128: return kernel_rows<128>(cols);
+    case 256: return kernel_rows<256>(cols);
+    default:  return kernel_rows<Eigen::Dynamic>(cols);
+    }
+}
 
 
 AffineLayer::AffineLayer(int insize, int outsize){
+    kernel = LinearKernel::get(outsize, insize);
     w = xavier(insize, outsize);
-    dw = cw = Mat::Zero(outsize, insize);
-    b = db = cb = Vec::Zero(outsize);
+    b = Vec::Zero(outsize);
+    if (! RunMode::inference_only){
+        dw = cw = Mat::Zero(outsize, insize);
+        db = cb = Vec::Zero(outsize);
+    }
 }
 
 void AffineLayer::fprop(const vector<Vec*> &data, Vec& output){
-    output = w * *(data[0]) + b;
+    if (! qw.empty()){
+        output.resize(qw.rows);
+        qw.gemv(data[0]->data(), output.data());
+        output += b;
+        return;
+    }
+    output = b;
+    kernel->fprop_add(w, *(data[0]), output);
 }
 
 void AffineLayer::bprop(const vector<Vec*> &data, const Vec& output, const Vec & out_derivative, vector<Vec*> &gradient){
     db += out_derivative;
-    dw += out_derivative * (*(data[0])).transpose();
-    *(gradient[0]) += w.transpose() * out_derivative;
+    kernel->bprop(w, dw, *(data[0]), out_derivative, *(gradient[0]));
 }
 
 void AffineLayer::get_params(vector<shared_ptr<Parameter>> &t){
-    t.push_back(shared_ptr<MatParam>(new MatParam(&w, &dw, &cw)));
+    t.push_back(shared_ptr<MatParam>(new MatParam(&w, &dw, &cw, &qw)));
     t.push_back(shared_ptr<VecParam>(new VecParam(&b, &db, &cb)));
 }
 
@@ -236,22 +488,49 @@ void AffineLayer::get_params(vector<shared_ptr<Parameter>> &t){
 
 LinearLayer::LinearLayer(int insize, int outsize){
     //cerr << " in : " << insize << "    " << "  out  " << outsize << endl;
+    kernel = LinearKernel::get(outsize, insize);
     w = xavier(insize, outsize);
-    dw = cw = Mat::Zero(outsize, insize);
+    if (! RunMode::inference_only){
+        dw = cw = Mat::Zero(outsize, insize);
+    }
 }
 void LinearLayer::fprop(const vector<Vec*> &data, Vec& output){
 //    cerr << data[0]->rows() << " " << data[0]->cols() << endl;
 //    cerr << output.rows() << endl;
 //    cerr << w.rows() << " " << w.cols() << endl;
 //    cerr << endl;
-    output = w * *(data[0]);
+    if (! qw.empty()){
+        output.resize(qw.rows);
+        qw.gemv(data[0]->data(), output.data());
+        return;
+    }
+    kernel->fprop(w, *(data[0]), output);
+}
+void LinearLayer::fprop_add(const Vec &x, Vec &y){
+    if (! qw.empty()){
+        qw.gemv(x.data(), y.data(), true);
+        return;
+    }
+    kernel->fprop_add(w, x, y);
+}
+void LinearLayer::fprop_add(const Mat &x, Mat &y, int row){
+    if (! qw.empty()){
+        for (int t = 0; t < x.cols(); t++){
+            qw.gemv(x.col(t).data(), y.col(t).data() + row, true);
+        }
+        return;
+    }
+    y.middleRows(row, w.rows()).noalias() += w * x;
+}
+void LinearLayer::bprop(const Mat &x, const Mat &dy, int row, Mat &dx){
+    dw.noalias() += dy.middleRows(row, w.rows()) * x.transpose();
+    dx.noalias() += w.transpose() * dy.middleRows(row, w.rows());
 }
 void LinearLayer::bprop(const vector<Vec*> &data, const Vec& output, const Vec & out_derivative, vector<Vec*> &gradient){
-    dw += out_derivative * (*(data[0])).transpose();
-    *(gradient[0]) += w.transpose() * out_derivative;
+    kernel->bprop(w, dw, *(data[0]), out_derivative, *(gradient[0]));
 }
 void LinearLayer::get_params(vector<shared_ptr<Parameter>> &t){
-    t.push_back(shared_ptr<MatParam>(new MatParam(&w, &dw, &cw)));
+    t.push_back(shared_ptr<MatParam>(new MatParam(&w, &dw, &cw, &qw)));
 }
 
 
@@ -262,7 +541,10 @@ void LinearLayer::get_params(vector<shared_ptr<Parameter>> &t){
 MultipleLinearLayer::MultipleLinearLayer(int insize, vector<int> &insizes, int outsize){
     //cerr << "MLL insize  " << insize << "   insizes " << insizes.size() << endl;
     assert(insize == insizes.size());
-    b = db = cb = Vec::Zero(outsize);
+    b = Vec::Zero(outsize);
+    if (! RunMode::inference_only){
+        db = cb = Vec::Zero(outsize);
+    }
     layers.resize(insize);
     for (int i = 0; i < layers.size(); i++){
         layers[i] = new LinearLayer(insizes[i], outsize);
@@ -277,9 +559,7 @@ MultipleLinearLayer::~MultipleLinearLayer(){
 void MultipleLinearLayer::fprop(const vector<Vec*> &data, Vec& output){
     output = b;
     for (int i = 0; i < layers.size(); i++){
-        vector<Vec*> datum{data[i]};
-        layers[i]->fprop(datum, buffer);
-        output += buffer;
+        layers[i]->fprop_add(*data[i], output);
     }
 }
 
@@ -307,9 +587,12 @@ void MultipleLinearLayer::get_params(vector<shared_ptr<Parameter>> &t){
 RecurrentLayer::RecurrentLayer(int insize, int outsize){
     w = xavier(insize, outsize);
     rw = xavier(outsize, outsize);
-    dw = cw = Mat::Zero(outsize, insize);
-    drw = crw = Mat::Zero(outsize, outsize);
-    b = db = cb = Vec::Zero(outsize);
+    b = Vec::Zero(outsize);
+    if (! RunMode::inference_only){
+        dw = cw = Mat::Zero(outsize, insize);
+        drw = crw = Mat::Zero(outsize, outsize);
+        db = cb = Vec::Zero(outsize);
+    }
 }
 void RecurrentLayer::fprop(const vector<Vec*> &data, Vec& output){
     output = w * *(data[0]) + rw * *(data[1]) + b;
@@ -334,7 +617,10 @@ void RecurrentLayer::get_params(vector<shared_ptr<Parameter>> &t){
 
 
 AddBias::AddBias(int outsize){
-    b = db = cb = Vec::Zero(outsize);
+    b = Vec::Zero(outsize);
+    if (! RunMode::inference_only){
+        db = cb = Vec::Zero(outsize);
+    }
 }
 void AddBias::fprop(const vector<Vec*> &data, Vec& output){
     output = *(data[0]) + b;
@@ -351,7 +637,9 @@ void AddBias::get_params(vector<shared_ptr<Parameter>> &t){
 
 ConstantLayer::ConstantLayer(int outsize){
     b = Vec::Random(outsize) / 100;
-    db = cb = Vec::Zero(outsize);
+    if (! RunMode::inference_only){
+        db = cb = Vec::Zero(outsize);
+    }
 }
 void ConstantLayer::fprop(const vector<Vec*> &data, Vec& output){
     output = b;
@@ -462,7 +750,16 @@ void Square::bprop(const vector<Vec*> &data, const Vec& output, const Vec & out_
 
 // Activation
 
+Tanh::Tanh():fast(false){}
+void Tanh::set_fast_activations(bool fast){
+    this->fast = fast;
+}
 void Tanh::fprop(const vector<Vec*> &data, Vec& output){
+    if (fast){
+        output.resize(data[0]->size());
+        act::tanh(data[0]->data(), output.data(), output.size());
+        return;
+    }
     output = (*(data[0])).unaryExpr(std::ptr_fun<double, double>(tanh));
 }
 void Tanh::bprop(const vector<Vec*> &data, const Vec& output, const Vec & out_derivative, vector<Vec*> &gradient){
@@ -472,10 +769,19 @@ void Tanh::bprop(const vector<Vec*> &data, const Vec& output, const Vec & out_de
 
 
 
+Sigmoid::Sigmoid():fast(false){}
+void Sigmoid::set_fast_activations(bool fast){
+    this->fast = fast;
+}
 void Sigmoid::fprop(const vector<Vec*> &data, Vec& output){
     //cout << output << endl;
     //cout << data.size() << endl;
     assert(data[0] != NULL);
+    if (fast){
+        output.resize(data[0]->size());
+        act::sigmoid(data[0]->data(), output.data(), output.size());
+        return;
+    }
 //    for (int i = 0; i < data.size(); i++){
 //        cout << *data[i] << endl;
 //    }
@@ -500,8 +806,17 @@ void ReLU::bprop(const vector<Vec*> &data, const Vec& output, const Vec & out_de
 
 
 
+Softmax::Softmax():fast(false){}
+void Softmax::set_fast_activations(bool fast){
+    this->fast = fast;
+}
 void Softmax::fprop(const vector<Vec*> &data, Vec& output){
-    output = ((data[0])->array() - (data[0])->maxCoeff()).exp();
+    if (fast){
+        output = (data[0])->array() - (data[0])->maxCoeff();
+        act::exp(output.data(), output.data(), output.size());
+    }else{
+        output = ((data[0])->array() - (data[0])->maxCoeff()).exp();
+    }
     output /= output.sum();
 }
 void Softmax::bprop(const vector<Vec*> &data, const Vec& output, const Vec & out_derivative, vector<Vec*> &gradient){
@@ -510,8 +825,18 @@ void Softmax::bprop(const vector<Vec*> &data, const Vec& output, const Vec & out
 }
 
 
+SoftmaxFilter::SoftmaxFilter():fast(false){}
+void SoftmaxFilter::set_fast_activations(bool fast){
+    this->fast = fast;
+}
 void SoftmaxFilter::fprop(const vector<Vec*> &data, Vec& output){
-    output = ((data[0])->array() - (data[0])->maxCoeff()).exp() * data[1]->array();
+    if (fast){
+        output = (data[0])->array() - (data[0])->maxCoeff();
+        act::exp(output.data(), output.data(), output.size());
+        output.array() *= data[1]->array();
+    }else{
+        output = ((data[0])->array() - (data[0])->maxCoeff()).exp() * data[1]->array();
+    }
     output /= output.sum();
 }
 void SoftmaxFilter::bprop(const vector<Vec*> &data, const Vec& output, const Vec & out_derivative, vector<Vec*> &gradient){
@@ -521,6 +846,84 @@ void SoftmaxFilter::bprop(const vector<Vec*> &data, const Vec& output, const Vec
 
 
 
+FusedSoftmaxHead::FusedSoftmaxHead():fast(false){}
+
+void FusedSoftmaxHead::set_tasks(const vector<MultipleLinearLayer*> &tasks){
+    this->tasks = tasks;
+    offsets.assign(1, 0);
+    for (int t = 0; t < tasks.size(); t++){
+        offsets.push_back(offsets.back() + tasks[t]->b.size());
+    }
+}
+
+int FusedSoftmaxHead::n_tasks() const{
+    return tasks.size();
+}
+
+int FusedSoftmaxHead::input_size() const{
+    assert(! tasks.empty());
+    int cols = 0;
+    for (LinearLayer *l : tasks[0]->layers){
+        cols += l->w.cols();
+    }
+    return cols;
+}
+
+void FusedSoftmaxHead::fprop(bool normalize){
+    p.resize(offsets.back(), x.cols());
+    for (int t = 0; t < tasks.size(); t++){
+        auto logits = p.middleRows(offsets[t], offsets[t+1] - offsets[t]);
+        logits.colwise() = tasks[t]->b;
+        int c = 0;
+        for (LinearLayer *l : tasks[t]->layers){
+            logits.noalias() += l->w * x.middleRows(c, l->w.cols());
+            c += l->w.cols();
+        }
+    }
+    if (! normalize){
+        return;
+    }
+    for (int j = 0; j < p.cols(); j++){
+        for (int t = 0; t < tasks.size(); t++){
+            int n = offsets[t+1] - offsets[t];
+            auto logits = p.col(j).segment(offsets[t], n);
+            logits.array() -= logits.maxCoeff();
+            if (fast){
+                act::exp(logits.data(), logits.data(), n);
+            }else{
+                logits = logits.array().exp();
+            }
+            logits /= logits.sum();
+        }
+    }
+}
+
+void FusedSoftmaxHead::bprop(const LabelView &targets, Mat &dx){
+    dlogits = p;
+    for (int j = 0; j < p.cols(); j++){
+        for (int t = 0; t < tasks.size(); t++){
+            dlogits(offsets[t] + targets[j][t], j) -= 1;
+        }
+    }
+    dx.setZero(x.rows(), x.cols());
+    for (int t = 0; t < tasks.size(); t++){
+        auto dlogits_t = dlogits.middleRows(offsets[t], offsets[t+1] - offsets[t]);
+        int c = 0;
+        for (LinearLayer *l : tasks[t]->layers){
+            l->dw.noalias() += dlogits_t * x.middleRows(c, l->w.cols()).transpose();
+            dx.middleRows(c, l->w.cols()).noalias() += l->w.transpose() * dlogits_t;
+            c += l->w.cols();
+        }
+        tasks[t]->db += dlogits_t.rowwise().sum();
+    }
+}
+
+void FusedSoftmaxHead::memory_usage(MemoryReport &report) const{
+    report.add(MemoryReport::GRAPH, (x.size() + p.size() + dlogits.size()) * sizeof(double));
+}
+
+
+
 
 
 
@@ -542,6 +945,10 @@ LookupTable::LookupTable(const LookupTable &other){
     v = other.v;
     dv = other.dv;
     cv = other.cv;
+    last_update = other.last_update;
+    optimizer = other.optimizer;
+    m1 = other.m1;
+    m2 = other.m2;
     vocsize = other.vocsize;
     dimension = other.dimension;
 }
@@ -550,6 +957,10 @@ LookupTable& LookupTable::operator=(const LookupTable &other){
     v = other.v;
     dv = other.dv;
     cv = other.cv;
+    last_update = other.last_update;
+    optimizer = other.optimizer;
+    m1 = other.m1;
+    m2 = other.m2;
     vocsize = other.vocsize;
     dimension = other.dimension;
     return *this;
@@ -558,13 +969,15 @@ LookupTable& LookupTable::operator=(const LookupTable &other){
 LookupTable::LookupTable(int vocsize, int dimension){
     this->vocsize = vocsize;
     this->dimension = dimension;
+    optimizer = nullptr;
     v = vector<Vec>(vocsize);
-    dv = vector<Vec>(vocsize);
-    cv = vector<Vec>(vocsize);
     for (int i = 0; i < vocsize; i++){
-        dv[i] = cv[i] = Vec::Zero(dimension);
         v[i] = Vec::Random(dimension) / 100.0;
     }
+    if (! RunMode::inference_only){
+        dv = cv = vector<Vec>(vocsize, Vec::Zero(dimension));
+        last_update = vector<int>(vocsize, 0);
+    }
 }
 
 void LookupTable::get(int i, shared_ptr<VecParam> &param){
@@ -576,14 +989,40 @@ void LookupTable::get(int i, shared_ptr<VecParam> &param){
         i = enc::UNKNOWN;
     }
     if (active.find(i) == active.end()){
-        active[i] = shared_ptr<VecParam>(new VecParam(&(v[i]), &(dv[i]), &(cv[i])));
+        if (dv.empty()){ // inference only, or model loaded from disk
+            active[i] = shared_ptr<VecParam>(new VecParam(&(v[i]), nullptr, nullptr));
+        }else{
+            active[i] = shared_ptr<VecParam>(new VecParam(&(v[i]), &(dv[i]), &(cv[i])));
+        }
     }
     param = active[i];
 }
 
 void LookupTable::update(double lr, double T, double clip, bool clipping, bool gaussian, double gaussian_eta){
+    int n_moments = optimizer == nullptr ? 0 : optimizer->n_moments();
+    if (n_moments > 0 && m1.empty()){
+        m1 = vector<Vec>(vocsize, Vec::Zero(dimension));
+        if (n_moments > 1){
+            m2 = vector<Vec>(vocsize, Vec::Zero(dimension));
+        }
+    }
     for (auto it = active.begin(); it != active.end(); it++){
-        it->second->update(lr, T, clip, clipping, gaussian, gaussian_eta);
+        int i = it->first;
+        VecParam &p = *(it->second);
+        if (n_moments > 0){
+            p.optimizer = optimizer;
+            p.m1 = m1[i].data();
+            if (n_moments > 1){
+                p.m2 = m2[i].data();
+                int skipped = last_update[i] > 0 ? T - last_update[i] : 0;
+                if (skipped > 0){   // steps with a zero gradient for this row
+                    m1[i] *= pow(optimizer->beta1, skipped);
+                    m2[i] *= pow(optimizer->beta2, skipped);
+                }
+            }
+        }
+        p.update(lr, T, clip, clipping, gaussian, gaussian_eta);
+        last_update[i] = T + 1;
     }
     active.clear();
 }
@@ -609,9 +1048,23 @@ void LookupTable::get_active_params(vector<shared_ptr<Parameter>> &params){
 }
 
 void LookupTable::average(int T){
+    for (int i = 0; i < last_update.size(); i++){
+        if (last_update[i] > 0){  // rows never updated have cv == 0
+            v[i] -= cv[i] / T;
+        }
+    }
+}
+
+void LookupTable::assign_average(const LookupTable &other, double T){
+    vocsize = other.vocsize;
+    dimension = other.dimension;
+    v.resize(vocsize);
     for (int i = 0; i < vocsize; i++){
-        VecParam p(&v[i], &dv[i], &cv[i]);
-        p.average(T);
+        if (i < other.last_update.size() && other.last_update[i] > 0){
+            v[i] = other.v[i] - other.cv[i] / T;
+        }else{
+            v[i] = other.v[i];
+        }
     }
 }
 
@@ -639,10 +1092,36 @@ void LookupTable::load(const string &filename){
     assert(consistent_dimension());
 }
 
+void LookupTable::memory_usage(MemoryReport &report){
+    size_t bytes = v.capacity() * sizeof(Vec);
+    for (Vec &x : v){
+        bytes += x.size() * sizeof(double);
+    }
+    report.add(MemoryReport::EMBEDDINGS, bytes);
+
+    bytes = dv.capacity() * sizeof(Vec);
+    for (Vec &x : dv){
+        bytes += x.size() * sizeof(double);
+    }
+    report.add(MemoryReport::GRADIENTS, bytes);
+
+    bytes = cv.capacity() * sizeof(Vec);
+    for (Vec &x : cv){
+        bytes += x.size() * sizeof(double);
+    }
+    report.add(MemoryReport::AVERAGING, bytes);
+
+    bytes = (m1.capacity() + m2.capacity()) * sizeof(Vec) + (m1.size() + m2.size()) * dimension * sizeof(double);
+    report.add(MemoryReport::OPTIMIZER, bytes);
+}
+
 void LookupTable::clear(){
     v.clear();
     dv.clear();
     cv.clear();
+    last_update.clear();
+    m1.clear();
+    m2.clear();
 }
 
 bool LookupTable::consistent_dimension(){
@@ -654,8 +1133,11 @@ bool LookupTable::consistent_dimension(){
 }
 
 void LookupTable::reset_gradient_history(){
-    for (int i = 0; i < cv.size(); i++){
-        cv[i].fill(0.0);
+    for (int i = 0; i < last_update.size(); i++){
+        if (last_update[i] > 0){
+            cv[i].fill(0.0);
+            last_update[i] = 0;
+        }
     }
 }
 
@@ -683,10 +1165,24 @@ Vec* LookupNode::v(){ return embedding.b;}
 Vec* LookupNode::d(){ return embedding.db;}
 
 
-NeuralNode::~NeuralNode(){}
+std::atomic<size_t> NeuralNode::live_bytes(0);
+std::atomic<size_t> NeuralNode::peak_bytes(0);
+
+NeuralNode::~NeuralNode(){
+    live_bytes -= (state.size() + dstate.size()) * sizeof(double);
+}
 NeuralNode::NeuralNode(int size){
     state = Vec::Zero(size);
-    dstate = Vec::Zero(size);
+    if (! RunMode::inference_only){
+        dstate = Vec::Zero(size);
+    }
+    size_t live = (live_bytes += (state.size() + dstate.size()) * sizeof(double));
+    size_t peak = peak_bytes;
+    while (live > peak && ! peak_bytes.compare_exchange_weak(peak, live)){}
+}
+
+void NeuralNode::reset_peak_bytes(){
+    peak_bytes = live_bytes.load();
 }
 
 Vec* NeuralNode::v(){return &state;}
@@ -713,7 +1209,7 @@ void SimpleNode::bprop(){
 
 
 
-ComplexNode::ComplexNode(int size, Layer *layer, vector<shared_ptr<AbstractNeuralNode> > &input)
+ComplexNode::ComplexNode(int size, Layer *layer, const vector<shared_ptr<AbstractNeuralNode> > &input)
     : NeuralNode(size),
       layer(layer),
       input(input){
@@ -815,6 +1311,140 @@ int RecurrentLayerWrapper::size(){
     return layers.size();
 }
 
+void RecurrentLayerWrapper::set_fast_activations(bool fast){
+    for (int i = 0; i < layers.size(); i++){
+        layers[i]->set_fast_activations(fast);
+    }
+}
+
+void RecurrentLayerWrapper::get_gates(vector<MultipleLinearLayer*> &gates){
+    for (int i = 0; i < layers.size(); i++){
+        MultipleLinearLayer *gate = dynamic_cast<MultipleLinearLayer*>(layers[i]);
+        if (gate != nullptr){
+            gates.push_back(gate);
+        }
+    }
+}
+
+
+
+ProjectedNode::ProjectedNode(int size, Layer *layer, shared_ptr<AbstractNeuralNode> &h, InputProjection *projection, int t)
+    : ComplexNode(size, layer, {h}),
+      projection(projection),
+      row(projection->offset(layer)),
+      t(t){
+    projection->nodes.push_back(this);
+}
+
+void ProjectedNode::fprop(){
+    state = projection->p.col(t).segment(row, state.size());
+    static_cast<MultipleLinearLayer*>(layer)->layers.back()->fprop_add(*input[0]->v(), state);
+}
+
+void ProjectedNode::bprop(){
+    MultipleLinearLayer *gate = static_cast<MultipleLinearLayer*>(layer);
+    gate->db += dstate;
+    vector<Vec*> data{input[0]->v()};
+    vector<Vec*> data_grad{input[0]->d()};
+    gate->layers.back()->bprop(data, state, dstate, data_grad);
+}
+
+
+
+void InputProjection::set_gates(const vector<MultipleLinearLayer*> &gates){
+    this->gates = gates;
+    offsets = {0};
+    for (MultipleLinearLayer *gate : gates){
+        offsets.push_back(offsets.back() + gate->b.size());
+    }
+}
+
+int InputProjection::offset(const Layer *gate) const{
+    for (int g = 0; g < gates.size(); g++){
+        if (gates[g] == gate){
+            return offsets[g];
+        }
+    }
+    assert(false && "Not a gate of this projection");
+    return -1;
+}
+
+void InputProjection::clear(){
+    input.clear();
+    nodes.clear();
+}
+
+int InputProjection::add_timestep(const vector<shared_ptr<AbstractNeuralNode>> &input_nodes){
+    input.push_back(input_nodes);
+    return input.size() - 1;
+}
+
+void InputProjection::fprop(){
+    gather_input();
+    project(0, gates.size());
+}
+
+void InputProjection::gather_input(){
+    int T = input.size();
+    if (T == 0){
+        return;
+    }
+    int K = input[0].size();
+    x.resize(K);
+    for (int k = 0; k < K; k++){
+        x[k].resize(input[0][k]->v()->size(), T);
+        for (int t = 0; t < T; t++){
+            x[k].col(t) = *input[t][k]->v();
+        }
+    }
+    p.resize(offsets.back(), T);
+}
+
+void InputProjection::project(int first_gate, int end_gate){
+    if (input.empty()){
+        return;
+    }
+    for (int g = first_gate; g < end_gate; g++){
+        p.middleRows(offsets[g], gates[g]->b.size()).colwise() = gates[g]->b;
+        for (int k = 0; k < x.size(); k++){
+            gates[g]->layers[k]->fprop_add(x[k], p, offsets[g]);
+        }
+    }
+}
+
+void InputProjection::bprop(){
+    int T = input.size();
+    if (T == 0){
+        return;
+    }
+    int K = input[0].size();
+    dp.resize(p.rows(), p.cols());
+    for (ProjectedNode *node : nodes){
+        dp.col(node->t).segment(node->row, node->dstate.size()) = node->dstate;
+    }
+    dx.resize(K);
+    for (int k = 0; k < K; k++){
+        dx[k].setZero(x[k].rows(), T);
+        for (int g = 0; g < gates.size(); g++){
+            gates[g]->layers[k]->bprop(x[k], dp, offsets[g], dx[k]);
+        }
+        for (int t = 0; t < T; t++){
+            *input[t][k]->d() += dx[k].col(t);
+        }
+    }
+}
+
+void InputProjection::memory_usage(MemoryReport &report) const{
+    size_t n = p.size() + dp.size();
+    for (int k = 0; k < x.size(); k++){
+        n += x[k].size();
+    }
+    for (int k = 0; k < dx.size(); k++){
+        n += dx[k].size();
+    }
+    report.add(MemoryReport::GRAPH, n * sizeof(double));
+}
+
 
 ParamNode::ParamNode(int size, Layer *layer):NeuralNode(size),layer(layer){}
 
@@ -847,7 +1477,19 @@ void MemoryNodeInitial::bprop(){
 
 
 
-GruNode::GruNode(int size, shared_ptr<AbstractNeuralNode> &predecessor, vector<shared_ptr<AbstractNeuralNode> > &input, RecurrentLayerWrapper &layers)
+namespace {
+// Gate pre-activation: from the input projection if any, else from all inputs
+shared_ptr<ComplexNode> gate_node(int size, Layer *layer, vector<shared_ptr<AbstractNeuralNode>> &input,
+                                  InputProjection *projection, int t){
+    if (projection == nullptr){
+        return shared_ptr<ComplexNode>(new ComplexNode(size, layer, input));
+    }
+    return shared_ptr<ComplexNode>(new ProjectedNode(size, layer, input.back(), projection, t));
+}
+}
+
+GruNode::GruNode(int size, shared_ptr<AbstractNeuralNode> &predecessor, vector<shared_ptr<AbstractNeuralNode> > &input, RecurrentLayerWrapper &layers,
+                 InputProjection *projection, int t)
     : ComplexNode(size,nullptr,input){
 
     this->pred = std::static_pointer_cast<GruNode>(predecessor);
@@ -858,10 +1500,10 @@ GruNode::GruNode(int size, shared_ptr<AbstractNeuralNode> &predecessor, vector<s
     shared_ptr<AbstractNeuralNode> h_node;
     pred->get_memory_node(h_node);
     z_in.push_back(h_node);
-    pz = shared_ptr<ComplexNode>(new ComplexNode(size, layers[Z1], z_in));
+    pz = gate_node(size, layers[Z1], z_in, projection, t);
     z  = shared_ptr<SimpleNode>(new SimpleNode(size, layers[Z2], pz));
 
-    pr = shared_ptr<ComplexNode>(new ComplexNode(size, layers[R1], z_in));
+    pr = gate_node(size, layers[R1], z_in, projection, t);
     r  = shared_ptr<SimpleNode>(new SimpleNode(size, layers[R2], pr));
 
 
@@ -869,7 +1511,7 @@ GruNode::GruNode(int size, shared_ptr<AbstractNeuralNode> &predecessor, vector<s
     hr = shared_ptr<ComplexNode>(new ComplexNode(size, layers[H1], h_in));
     vector<shared_ptr<AbstractNeuralNode>> h2_in(input);
     h2_in.push_back(hr);
-    ph = shared_ptr<ComplexNode>(new ComplexNode(size, layers[H2], h2_in));
+    ph = gate_node(size, layers[H2], h2_in, projection, t);
     h = shared_ptr<SimpleNode>(new SimpleNode(size, layers[H3], ph));
 
     internal_nodes = {pz, z, pr, r, hr, ph, h};
@@ -910,13 +1552,14 @@ void GruNode::get_memory_node(shared_ptr<AbstractNeuralNode> &hnode){
 RnnNode::RnnNode(int size,
                  shared_ptr<AbstractNeuralNode> &predecessor,
                  vector<shared_ptr<AbstractNeuralNode>> &input,
-                 RecurrentLayerWrapper &layers)
+                 RecurrentLayerWrapper &layers,
+                 InputProjection *projection, int t)
             : ComplexNode(size,nullptr,input){
     pred = predecessor;
 
     vector<shared_ptr<AbstractNeuralNode>> h_in(input);
     h_in.push_back(pred);
-    h = shared_ptr<ComplexNode>(new ComplexNode(size, layers[REC], h_in));
+    h = gate_node(size, layers[REC], h_in, projection, t);
     layer = layers[ACTIVATION];
 }
 RnnNode::~RnnNode(){}
@@ -952,7 +1595,8 @@ LstmNode::LstmNode(int size, vector<shared_ptr<AbstractNeuralNode>> &input)
 LstmNode::LstmNode(int size,
                    shared_ptr<AbstractNeuralNode> &predecessor,
                    vector<shared_ptr<AbstractNeuralNode>> &input,
-                   RecurrentLayerWrapper &layers)
+                   RecurrentLayerWrapper &layers,
+                   InputProjection *projection, int t)
                 : LstmNode(size,input){
 
     assert(predecessor.get() != NULL);
@@ -964,16 +1608,16 @@ LstmNode::LstmNode(int size,
     vector<shared_ptr<AbstractNeuralNode>> in(input);
     in.push_back(predecessor);
 
-    ia = shared_ptr<ComplexNode>(new ComplexNode(size, layers[I], in));
+    ia = gate_node(size, layers[I], in, projection, t);
     ih = shared_ptr<SimpleNode>(new SimpleNode(size, layers[IS], ia));
 
-    fa = shared_ptr<ComplexNode>(new ComplexNode(size, layers[F], in));
+    fa = gate_node(size, layers[F], in, projection, t);
     fh = shared_ptr<SimpleNode>(new SimpleNode(size, layers[FS], fa));
 
-    oa = shared_ptr<ComplexNode>(new ComplexNode(size, layers[O], in));
+    oa = gate_node(size, layers[O], in, projection, t);
     oh = shared_ptr<SimpleNode>(new SimpleNode(size, layers[OS], oa));
 
-    ga = shared_ptr<ComplexNode>(new ComplexNode(size, layers[G], in));
+    ga = gate_node(size, layers[G], in, projection, t);
     gh = shared_ptr<SimpleNode>(new SimpleNode(size, layers[GT], ga));
 
     shared_ptr<AbstractNeuralNode> memory_node;
@@ -1022,7 +1666,8 @@ void LstmNode::get_memory_node(shared_ptr<AbstractNeuralNode> &hnode){
 LnLstmNode::LnLstmNode(int size,
                        shared_ptr<AbstractNeuralNode> &predecessor,
                        vector<shared_ptr<AbstractNeuralNode>> &input,
-                       RecurrentLayerWrapper &layers) : LstmNode(size, input){
+                       RecurrentLayerWrapper &layers,
+                       InputProjection *projection, int t) : LstmNode(size, input){
     assert(predecessor.get() != NULL);
 
     this->pred = std::static_pointer_cast<LstmNode>(predecessor);
@@ -1032,19 +1677,19 @@ LnLstmNode::LnLstmNode(int size,
     vector<shared_ptr<AbstractNeuralNode>> in(input);
     in.push_back(predecessor);
 
-    ia = shared_ptr<ComplexNode>(new ComplexNode(size, layers[I], in)); // Layer norm ->
+    ia = gate_node(size, layers[I], in, projection, t); // Layer norm ->
     ln_ia = shared_ptr<LayerNormNode>(new LayerNormNode(size, ia));
     ih = shared_ptr<SimpleNode>(new SimpleNode(size, layers[IS], ln_ia));
 
-    fa = shared_ptr<ComplexNode>(new ComplexNode(size, layers[F], in)); // Layer norm ->
+    fa = gate_node(size, layers[F], in, projection, t); // Layer norm ->
     ln_fa = shared_ptr<LayerNormNode>(new LayerNormNode(size, fa));
     fh = shared_ptr<SimpleNode>(new SimpleNode(size, layers[FS], ln_fa));
 
-    oa = shared_ptr<ComplexNode>(new ComplexNode(size, layers[O], in)); // Layer norm ->
+    oa = gate_node(size, layers[O], in, projection, t); // Layer norm ->
     ln_oa = shared_ptr<LayerNormNode>(new LayerNormNode(size, oa));
     oh = shared_ptr<SimpleNode>(new SimpleNode(size, layers[OS], ln_oa));
 
-    ga = shared_ptr<ComplexNode>(new ComplexNode(size, layers[G], in)); // layer norm ->
+    ga = gate_node(size, layers[G], in, projection, t); // layer norm ->
     ln_ga = shared_ptr<LayerNormNode>(new LayerNormNode(size, ga));
     gh = shared_ptr<SimpleNode>(new SimpleNode(size, layers[GT], ln_ga));
 
@@ -10,10 +10,14 @@
 #include <cmath>
 #include <random>
 #include <memory>
+#include <atomic>
+#include <limits>
+#include <algorithm>
 
 #include "str_utils.h"
 #include "random_utils.h"
 #include "utils.h"
+#include "quantization.h"
 
 #define DBG(x) cerr << x << endl;
 ////
@@ -41,6 +45,14 @@ Mat xavier(int insize, int outsize);
 
 double rectifier(double x);
 
+// Standard deviation of gradient noise at step T
+double noise_sigma(double T, double gaussian_eta);
+
+// Fused update kernel on arrays of size n:
+// g += N(0, sigma^2) noise (if sigma > 0), g clipped to [-clip, clip] (if clip > 0),
+// w -= lr * g, c -= lr * T * g (if avg), g = 0
+void sgd_step(double *w, double *g, double *c, int n, double lr, double T, bool avg, double clip, double sigma);
+
 
 
 template <class M>
@@ -72,10 +84,69 @@ void load_matrix(std::string filename, M &res){
 
 
 
+/**
+ * @brief The RunMode struct holds global switches read at model construction.
+ * When inference_only is set, layers and lookup tables do not allocate
+ * gradient (dw, db, dv) and averaging (cw, cb, cv) buffers, and graph
+ * nodes do not allocate dstate. Such models can only be used
+ * for prediction (no bprop / update).
+ * When input_projection is set (default), bi-rnn feature extractors
+ * compute the input side of all gates for a whole sentence before the
+ * recurrence (see InputProjection). Read when computation graphs are built.
+ */
+struct RunMode{
+    static bool inference_only;
+    static bool input_projection;
+};
+
+/**
+ * @brief The MemoryReport struct accumulates memory usage
+ * (bytes) by component. Filled by memory_usage() methods.
+ */
+struct MemoryReport{
+    enum {PARAMETERS, GRADIENTS, AVERAGING, OPTIMIZER, EMBEDDINGS, ENCODERS, CHAR_CACHE, PREDICTION_CACHE, GRAPH, N_COMPONENTS};
+    static const string names[N_COMPONENTS];
+
+    vector<size_t> bytes;
+
+    MemoryReport();
+    void add(int component, size_t b);
+    size_t total();
+    void print(ostream &os);
+};
+
+/**
+ * @brief The Optimizer struct selects the update rule applied
+ * to gradients (after noise and clipping). The learning rate
+ * (and its decay) is given to update(). ASGD averaging is
+ * maintained for all update rules.
+ *   SGD:     w -= lr * g
+ *   ADAGRAD: s += g^2, w -= lr * g / (sqrt(s) + epsilon)
+ *   ADAM:    m = b1 m + (1-b1) g, s = b2 s + (1-b2) g^2,
+ *            w -= lr * m / (1-b1^t) / (sqrt(s / (1-b2^t)) + epsilon)
+ */
+struct Optimizer{
+    enum {SGD, ADAGRAD, ADAM};
+    int type;
+    double beta1;
+    double beta2;
+    double epsilon;
+    Optimizer();
+    int n_moments() const;  // size of state (in number of parameters)
+};
+
+// Applies the update rule of optimizer on arrays of size n (see sgd_step).
+// m1, m2: optimizer state, t: step (from 1)
+void adaptive_step(const Optimizer &optimizer, double *w, double *g, double *c, double *m1, double *m2, int n,
+                   double lr, double t, bool avg, double clip, double sigma);
+
 /////////////////////////
 /// Parameters objects store pointers to parameters
 struct Parameter{
     bool avg;       // ASGD
+    const Optimizer *optimizer;     // nullptr: SGD
+    double *m1, *m2;                // optimizer state (moments), allocated on first update
+    Eigen::ArrayXd moments;         // storage for m1, m2 unless they point to lookup table rows
     Parameter();
     virtual ~Parameter();
     virtual void update(double lr, double T, double clip, bool clipping, bool gaussian, double gaussian_eta)=0;
@@ -85,17 +156,24 @@ struct Parameter{
     virtual void set_empirical_gradient(int i, double eg)=0;
     virtual void print_gradient_differences()=0;
     virtual void assign(shared_ptr<Parameter> &other)=0;
+    virtual void assign_average(shared_ptr<Parameter> &other, double T)=0; // ASGD average of other
     virtual void print(ostream &os)=0;
     virtual void load(const string &outfile)=0;
     virtual void reset_gradient_history()=0;
     virtual void scale_gradient(double p) = 0;
     virtual double gradient_squared_norm()=0;
+    virtual void memory_usage(MemoryReport &report)=0;
+    virtual void quantize();        // int8 inference weights (no-op unless supported), see quantization.h
     void export_model(const string &outfile);
+protected:
+    // Updates w (size n) with optimizer (SGD if none)
+    void step(double *w, double *g, double *c, int n, double lr, double T, double clip, bool clipping, bool gaussian, double gaussian_eta);
 };
 
 struct MatParam : public Parameter{
     Mat *w, *dw, *cw;
-    MatParam(Mat *w1, Mat *w2, Mat *w3);
+    QMat *q;        // nullptr if the layer has no quantized path
+    MatParam(Mat *w1, Mat *w2, Mat *w3, QMat *q=nullptr);
     ~MatParam();
     void update(double lr, double T, double clip, bool clipping, bool gaussian, double gaussian_eta);
     void average(double T);
@@ -104,11 +182,14 @@ struct MatParam : public Parameter{
     void set_empirical_gradient(int i, double eg);
     void print_gradient_differences();
     void assign(shared_ptr<Parameter> &other);
+    void assign_average(shared_ptr<Parameter> &other, double T);
     void print(ostream &os);
     void load(const string &outfile);
     void reset_gradient_history();
     void scale_gradient(double p);
     double gradient_squared_norm();
+    void memory_usage(MemoryReport &report);
+    void quantize();
 };
 
 struct VecParam : public Parameter{
@@ -123,11 +204,13 @@ struct VecParam : public Parameter{
     void set_empirical_gradient(int i, double eg);
     void print_gradient_differences();
     void assign(shared_ptr<Parameter> &other);
+    void assign_average(shared_ptr<Parameter> &other, double T);
     void print(ostream &os);
     void load(const string &outfile);
     void reset_gradient_history();
     void scale_gradient(double p);
     double gradient_squared_norm();
+    void memory_usage(MemoryReport &report);
 };
 
 struct Layer{
@@ -136,11 +219,28 @@ struct Layer{
     virtual void fprop(const vector<Vec*> &data, Vec& output)=0;
     virtual void bprop(const vector<Vec*> &data, const Vec& output, const Vec & out_derivative, vector<Vec*> &gradient)=0;
     virtual void get_params(vector<shared_ptr<Parameter>> &t);
+    virtual void set_fast_activations(bool fast);   // no-op except for activations (see activations.h)
+};
+
+/* Matrix-vector products of linear and affine layers, specialized at
+ * compile time for the common sizes 16, 32, 64, 128 and 256 (fixed-size
+ * Eigen maps over the same storage: unrolled loops, no size checks).
+ * Each dimension falls back to a dynamic size independently.
+ * Selected once, when the layer is built.
+ */
+struct LinearKernel{
+    void (*fprop)(const Mat &w, const Vec &x, Vec &y);                              // y = w x
+    void (*fprop_add)(const Mat &w, const Vec &x, Vec &y);                          // y += w x
+    void (*bprop)(const Mat &w, Mat &dw, const Vec &x, const Vec &dy, Vec &dx);     // dw += dy x^T, dx += w^T dy
+
+    static const LinearKernel* get(int rows, int cols);
 };
 
 struct AffineLayer : public Layer{
     Mat w, dw, cw;
+    QMat qw;        // used instead of w once quantized (inference only)
     Vec b, db, cb;
+    const LinearKernel *kernel;
     AffineLayer(int insize, int outsize);
     void fprop(const vector<Vec*> &data, Vec& output);
     void bprop(const vector<Vec*> &data, const Vec& output, const Vec & out_derivative, vector<Vec*> &gradient);
@@ -149,8 +249,14 @@ struct AffineLayer : public Layer{
 
 struct LinearLayer : public Layer{
     Mat w, dw, cw;
+    QMat qw;        // used instead of w once quantized (inference only)
+    const LinearKernel *kernel;
     LinearLayer(int insize, int outsize);
     void fprop(const vector<Vec*> &data, Vec& output);
+    void fprop_add(const Vec &x, Vec &y);       // y += w x
+    // Same on several columns (one per timestep), rows row .. row + w.rows()-1 of y / dy
+    void fprop_add(const Mat &x, Mat &y, int row);                  // y += w x
+    void bprop(const Mat &x, const Mat &dy, int row, Mat &dx);      // dw += dy x^T, dx += w^T dy
     void bprop(const vector<Vec*> &data, const Vec& output, const Vec & out_derivative, vector<Vec*> &gradient);
     void get_params(vector<shared_ptr<Parameter>> &t);
 };
@@ -158,7 +264,6 @@ struct LinearLayer : public Layer{
 struct MultipleLinearLayer : public Layer{
     vector<LinearLayer*> layers;
     Vec b, db, cb;
-    Vec buffer;
     MultipleLinearLayer(int insize, vector<int> &insizes, int outsize);
     ~MultipleLinearLayer();
     void fprop(const vector<Vec*> &data, Vec& output);
@@ -238,11 +343,17 @@ struct Square: public Layer{
 
 // Activation
 struct Tanh : public Layer{
+    bool fast;
+    Tanh();
+    void set_fast_activations(bool fast);
     void fprop(const vector<Vec*> &data, Vec& output);
     void bprop(const vector<Vec*> &data, const Vec& output, const Vec & out_derivative, vector<Vec*> &gradient);
 };
 
 struct Sigmoid : public Layer{
+    bool fast;
+    Sigmoid();
+    void set_fast_activations(bool fast);
     void fprop(const vector<Vec*> &data, Vec& output);
     void bprop(const vector<Vec*> &data, const Vec& output, const Vec & out_derivative, vector<Vec*> &gradient);
 };
@@ -253,22 +364,69 @@ struct ReLU : public Layer{
 };
 
 struct Softmax : public Layer{
+    bool fast;
+    Softmax();
+    void set_fast_activations(bool fast);
     void fprop(const vector<Vec*> &data, Vec& output);
     void bprop(const vector<Vec*> &data, const Vec& output, const Vec & out_derivative, vector<Vec*> &gradient);
 };
 
 struct SoftmaxFilter : public Layer{
+    bool fast;
+    SoftmaxFilter();
+    void set_fast_activations(bool fast);
     void fprop(const vector<Vec*> &data, Vec& output);
     void bprop(const vector<Vec*> &data, const Vec& output, const Vec & out_derivative, vector<Vec*> &gradient);
 };
 
 
 
+/**
+ * @brief The FusedSoftmaxHead struct computes several softmax classifiers
+ * (MultipleLinearLayer + Softmax per task) over the same inputs for a whole
+ * sentence: logits of all tokens are obtained with one matrix product per
+ * task input, followed by a softmax on each task segment.
+ * Weights are read from (and gradients accumulated in) the task layers:
+ * there is no copy to keep up to date.
+ */
+struct FusedSoftmaxHead{
+    vector<MultipleLinearLayer*> tasks;     // not owned
+    vector<int> offsets;    // task t: rows offsets[t] .. offsets[t+1]-1
+    Mat x;                  // inputs, one column per token (rows: concatenated input vectors)
+    Mat p;                  // probabilities (logits if not normalized), one column per token
+    Mat dlogits;
+    bool fast;              // fast approximation of exp (see activations.h)
+
+    FusedSoftmaxHead();
+    void set_tasks(const vector<MultipleLinearLayer*> &tasks);
+    int n_tasks() const;
+    int input_size() const;     // sum of the input sizes of a task
+
+    // p = segmented softmax(w x + b), or p = w x + b if not normalize (argmax only),
+    // w: task weights stacked by rows
+    void fprop(bool normalize=true);
+    // Accumulates task weight gradients and sets dx = w^T dlogits
+    // (targets[j][t]: gold class of token j for task t)
+    void bprop(const LabelView &targets, Mat &dx);
+    void memory_usage(MemoryReport &report) const;  // sentence buffers (graph)
+};
+
 struct LookupTable{
     vector<Vec> v;
     vector<Vec> dv;
     vector<Vec> cv;
 
+    // Step of last update of each row (0: never updated since last reset).
+    // average() and reset_gradient_history() only visit updated rows.
+    vector<int> last_update;
+
+    // Optimizer and its per-row state, allocated on first update (Adam / AdaGrad).
+    // State of rows not seen in a step is left untouched: Adam moments are
+    // decayed lazily when the row is next updated.
+    const Optimizer *optimizer;
+    vector<Vec> m1;
+    vector<Vec> m2;
+
     unordered_map<int, shared_ptr<VecParam>> active;
 
     int vocsize;
@@ -295,9 +453,14 @@ struct LookupTable{
 
     void average(int T);
 
+    // v = averaged embeddings of other (does not need gradient buffers)
+    void assign_average(const LookupTable &other, double T);
+
     void export_model(const string &filename);
 
     void load(const string &filename);
+
+    void memory_usage(MemoryReport &report);
     void clear();
 
     bool consistent_dimension();
@@ -364,6 +527,11 @@ struct NeuralNode : public AbstractNeuralNode{
     virtual ~NeuralNode();
     NeuralNode(int size);
 
+    // Bytes held by state / dstate of all living nodes (computation graph workspace)
+    static std::atomic<size_t> live_bytes;
+    static std::atomic<size_t> peak_bytes;
+    static void reset_peak_bytes();
+
     Vec* v();
     Vec* d();
 };
@@ -390,12 +558,67 @@ struct ComplexNode : public NeuralNode{
     Layer *layer;
     vector<shared_ptr<AbstractNeuralNode>> input;
 
-    ComplexNode(int size, Layer *layer, vector<shared_ptr<AbstractNeuralNode>> &input);
+    ComplexNode(int size, Layer *layer, const vector<shared_ptr<AbstractNeuralNode>> &input);
 
     void fprop();
     void bprop();
 };
 
+struct InputProjection;
+
+/**
+ * @brief The ProjectedNode struct computes the pre-activation
+ * of a gate at timestep t from the input projection precomputed
+ * for the whole sentence (bias and input side) and the
+ * recurrent term only: state = p(t) + w_h h.
+ * Its input node is the previous state h.
+ */
+struct ProjectedNode : public ComplexNode{
+    InputProjection *projection;
+    int row;    // first row of the gate in the projection
+    int t;
+
+    ProjectedNode(int size, Layer *layer, shared_ptr<AbstractNeuralNode> &h, InputProjection *projection, int t);
+
+    void fprop();
+    void bprop();   // recurrent term and bias, the input side is done by InputProjection::bprop()
+};
+
+/**
+ * @brief The InputProjection struct computes the input side of the
+ * gates of one or several recurrent layers sharing the same inputs
+ * (e.g. forward and backward layers at the same depth) for all the
+ * timesteps of a sentence: p = b + sum_k w_k x_k, with one matrix
+ * product per (gate, input) instead of one matrix-vector product per
+ * timestep. The sequential loop (ProjectedNode) then only computes
+ * the recurrent term.
+ * Weights are read from the gate layers (nothing to pack).
+ */
+struct InputProjection{
+    vector<MultipleLinearLayer*> gates;     // not owned, the last layer of each gate is the recurrent one
+    vector<int> offsets;                    // gate g: rows offsets[g] .. offsets[g+1]-1
+    vector<vector<shared_ptr<AbstractNeuralNode>>> input;  // input[t]: input nodes of timestep t
+    vector<ProjectedNode*> nodes;           // gate nodes of the current graph (owned by recurrent nodes)
+    vector<Mat> x;                          // x[k]: input k, one column per timestep
+    vector<Mat> dx;
+    Mat p;                                  // projections, one column per timestep
+    Mat dp;
+
+    void set_gates(const vector<MultipleLinearLayer*> &gates);
+    int offset(const Layer *gate) const;
+    void clear();                           // new graph
+    int add_timestep(const vector<shared_ptr<AbstractNeuralNode>> &input_nodes);
+
+    void fprop();   // inputs must have been computed: gather_input() then project() for all the gates
+
+    // fprop in two steps, so that the gates of different layers can be
+    // projected concurrently (e.g. each by the task running its layer)
+    void gather_input();                    // x from the input nodes
+    void project(int first_gate, int end_gate);
+    void bprop();   // after the bprop of all gate nodes, accumulates input gradients
+    void memory_usage(MemoryReport &report) const;  // sentence buffers (graph)
+};
+
 /**
  * @brief The RecurrentLayerWrapper struct is a wrapper
  * for the vector of functions required for typical
@@ -414,6 +637,8 @@ struct RecurrentLayerWrapper{
 
     Layer* operator[](int i);
     int size();
+    void set_fast_activations(bool fast);
+    void get_gates(vector<MultipleLinearLayer*> &gates);    // layers applied to inputs and previous state
 };
 
 
@@ -474,7 +699,8 @@ struct GruNode : public ComplexNode, public AbstractMemoryNode{
     GruNode(int size,
             shared_ptr<AbstractNeuralNode> &predecessor,
             vector<shared_ptr<AbstractNeuralNode>> &input,
-            RecurrentLayerWrapper &layers);
+            RecurrentLayerWrapper &layers,
+            InputProjection *projection = nullptr, int t = 0);
 
     ~GruNode();
 
@@ -495,7 +721,8 @@ struct RnnNode : public ComplexNode{
     RnnNode(int size,
             shared_ptr<AbstractNeuralNode> &predecessor,
             vector<shared_ptr<AbstractNeuralNode>> &input,
-            RecurrentLayerWrapper &layers);
+            RecurrentLayerWrapper &layers,
+            InputProjection *projection = nullptr, int t = 0);
 
     ~RnnNode();
 
@@ -533,7 +760,8 @@ struct LstmNode : public ComplexNode, public AbstractMemoryNode{ // See Goldberg
     LstmNode(int size,
              shared_ptr<AbstractNeuralNode> &predecessor,
              vector<shared_ptr<AbstractNeuralNode>> &input,
-             RecurrentLayerWrapper &layers);
+             RecurrentLayerWrapper &layers,
+             InputProjection *projection = nullptr, int t = 0);
 
     ~LstmNode();
 
@@ -556,7 +784,8 @@ struct LnLstmNode : public LstmNode{
     LnLstmNode(int size,
                shared_ptr<AbstractNeuralNode> &predecessor,
                vector<shared_ptr<AbstractNeuralNode>> &input,
-               RecurrentLayerWrapper &layers);
+               RecurrentLayerWrapper &layers,
+               InputProjection *projection = nullptr, int t = 0);
     ~LnLstmNode();
 };
 
@@ -1,12 +1,15 @@
 #include <getopt.h>
 #include <sys/stat.h>
 #include <unordered_map>
+#include <thread>
+#include <atomic>
 #include <boost/functional/hash.hpp>
 
 #include "conll_utils.h"
 #include "bilstm_tagger.h"
 #include "utils.h"
 #include "neural_net_hyperparameters.h"
+#include "logger.h"
 
 using std::pair;
 using std::make_pair;
@@ -16,7 +19,7 @@ struct EpochEval{
     Output output;
     float total;
     vector<float> a;
-    vector<float> l;
+    vector<double> l;
 
     unordered_map<pair<int, int>, int, boost::hash<pair<int, int>>> confusion;
 
@@ -29,7 +32,7 @@ struct EpochEval{
             size ++;
         }
         a = vector<float>(size, 0.0);
-        l = vector<float>(size, 0.0);
+        l = vector<double>(size, 0.0);
     }
 
     void update_losses(vector<float> &losses){
@@ -63,11 +66,13 @@ struct EpochEval{
         }
     }
 
+    // Ties are broken on the pair of labels so that the result
+    // does not depend on the iteration order of the hash map
     Pair most_frequent_error(){
         int num_errors = 0;
         Pair p(-1, -1);
         for (auto &it : confusion){
-            if (it.second > num_errors){
+            if (it.second > num_errors || (it.second == num_errors && it.first < make_pair(p.first, p.second))){
                 num_errors = it.second;
                 p.first = it.first.first;
                 p.second = it.first.second;
@@ -76,8 +81,7 @@ struct EpochEval{
         return p;
     }
 
-    void update(vector<int> &gold, vector<int> &pred){
-        assert(gold.size() == pred.size());
+    void update(const int *gold, vector<int> &pred){
         total += 1;
         int id = 0;
         int k = 0;
@@ -111,6 +115,17 @@ struct EpochEval{
         //assert(id == a.size());
         //assert(k == pred.size());
     }
+    // Adds the counts of another (partial) evaluation
+    void merge(const EpochEval &other){
+        total += other.total;
+        for (int i = 0; i < a.size(); i++){
+            a[i] += other.a[i];
+        }
+        for (auto &it : other.confusion){
+            confusion[it.first] += it.second;
+        }
+    }
+
     int size(){
         return a.size();
     }
@@ -136,17 +151,21 @@ struct EpochEval{
 
 struct EpochSummary{
     int epoch;
+    int sentences;
     EpochEval train;
     EpochEval dev;
 
     EpochSummary(int e,
+                 int sentences,
                  EpochEval &train,
                  EpochEval &dev):epoch(e),
+                                 sentences(sentences),
                                  train(train),
                                  dev(dev){}
 
     void print(ostream &os){
         os << "Epoch " << epoch
+           << " sentences " << sentences
            << " train " << train
            << " dev " << dev << endl;
     }
@@ -171,14 +190,34 @@ struct EpochSummary{
 
 
 
+// Every evaluation thread holds a full copy of the averaged model
+// (parameters and computation graph), reassigned before each evaluation
+const int DEFAULT_EVAL_THREADS = 4;
+const int MAX_EVAL_THREADS = 8;
+
 struct Options{
-    enum {TRAIN, TEST};
+    enum {TRAIN, TEST, QUANTIZE};
     string train_file;
     string dev_file;
     string test_file;
     string hyper_file;
     string output_dir = "mymodel";
+    string model_dir = "mymodel";   // model loaded in test / quantize mode
     int epochs = 20;
+    int min_tokens = 4000000;   // train on at least this many tokens (unless early stopping)
+    int patience = 0;           // stop after this many evaluations without improvement on dev (0: never)
+    int eval_every = 0;         // evaluate every K sentences (0: at the end of each epoch)
+    double time_budget = 0;     // stop training after this many seconds (0: no limit)
+    bool async_eval = true;     // evaluate and export in a background thread while training continues
+    int eval_threads = std::max<int>(1, std::min<int>(DEFAULT_EVAL_THREADS, std::thread::hardware_concurrency()));
+    string corpus_cache;        // compiled train + dev corpora, created if missing or stale
+    int rnn_threads = 1;        // threads for the recurrent layers of one sentence in test mode
+    int window = 0;             // test mode: tag long sentences in windows of this many tokens (0: off)
+    int window_context = 8;     // tokens of context on each side of a window
+    int max_word_chars = 0;     // test mode: characters read per word by the char-based encoder (0: all)
+    double cache_mb = 0;        // test mode: memory for predictions of already seen sentences (0: no cache)
+    int top_k = 0;              // test mode: k most probable labels with probabilities in MISC (0: argmax only)
+    bool mem_report = false;
     NeuralNetParameters params;
     int mode = 0;
 
@@ -194,8 +233,13 @@ struct Options{
             mode = TEST;
             return;
         }
+        if (mode_str == "quantize"){
+            cerr << "Mode = " << mode_str << endl;
+            mode = QUANTIZE;
+            return;
+        }
         cerr << "Unknown argument for -m / --mode option" << endl;
-        cerr << "Accepted arguments: 'train' or 'test'" << endl;
+        cerr << "Accepted arguments: 'train', 'test' or 'quantize'" << endl;
         exit(1);
     }
     bool check(){
@@ -213,13 +257,19 @@ struct Options{
                 return false;
             }
             return true;
+        }else if (mode == QUANTIZE){
+            if (model_dir == output_dir){
+                cerr << "Please specify an --output directory different from the model" << endl;
+                return false;
+            }
+            return true;
         }else{
             if (test_file.empty()){
                 cerr << "Please specify --test file" << endl;
                 return false;
             }
-            if (output_dir.empty()){
-                cerr << "Please specify --test file" << endl;
+            if (model_dir.empty()){
+                cerr << "Please specify --load-model option" << endl;
                 return false;
             }
             return true;
@@ -232,10 +282,12 @@ void print_help(){
 
         "Usage:" << endl <<
         "      ./main train -t <trainfile> - d <devfile> -i <epochs> -o <outputdir> [options]" << endl <<
-        "      ./main test -T <testfile> -l <model> [options]" << endl << endl <<
+        "      ./main test -T <testfile> -l <model> [options]" << endl <<
+        "      ./main quantize -l <model> -o <outputdir>" << endl << endl <<
         "Options:" << endl <<
         "  -h     --help                        displays this message and quits" << endl <<
-        "  -m     --mode            [STRING]    train|test" << endl <<
+        "  -m     --mode            [STRING]    train|test|quantize" << endl <<
+        "         --mem-report                  print memory usage by component (stderr)" << endl <<
         "Training mode options:" << endl <<
         "  -t     --train           [STRING]    training corpus (conll format)   " << endl <<
         "  -d     --dev             [STRING]    developpement corpus (conll format)   " << endl <<
@@ -243,28 +295,89 @@ void print_help(){
         "  -o     --output          [STRING]    output directory" << endl <<
         "  -p     --hyperparameters [STRING]    hyperparameters of neural net" << endl <<
         "  -M     --multitask       [STRING]    specify what to predict: xm" << endl <<
+        "         --min-tokens      [INT]       minimum number of training tokens [default=4000000]" << endl <<
+        "         --patience        [INT]       stop after INT evaluations without dev improvement [default=0: off]" << endl <<
+        "         --eval-every      [INT]       evaluate every INT sentences [default=0: every epoch]" << endl <<
+        "         --time-budget     [FLOAT]     stop training after FLOAT seconds [default=0: off]" << endl <<
+        "         --sync-eval                   block training during evaluation on dev" << endl <<
+        "         --eval-threads    [INT]       number of threads for evaluation, at most " << MAX_EVAL_THREADS << " [default=" << DEFAULT_EVAL_THREADS << "]" << endl <<
+        "         --corpus-cache    [STRING]    compiled train/dev corpus file (created if missing or outdated)" << endl <<
         "Testing mode options:" << endl <<
         "  -T     --test           [STRING]    training corpus (conll format)   " << endl <<
-        "  -l     --load-model      [STRING]    model directory" << endl << endl;
+        "  -l     --load-model      [STRING]    model directory" << endl <<
+        "         --rnn-threads     [INT]       threads per sentence (both directions, char-based words) [default=1]" << endl <<
+        "         --window          [INT]       tag sentences longer than INT tokens in windows (bounded memory) [default=0: off]" << endl <<
+        "         --window-context  [INT]       tokens of context on each side of a window [default=8]" << endl <<
+        "         --max-word-chars  [INT]       characters of a word read by the char-based encoder [default=0: all]" << endl <<
+        "         --cache-mb        [FLOAT]     cache predictions of duplicate sentences, LRU within FLOAT MB [default=0: off]" << endl <<
+        "         --top-k           [INT]       write the INT most probable labels of each task in MISC [default=0: off]" << endl <<
+        "Quantize mode options (int8 weights for inference, loaded as usual in test mode):" << endl <<
+        "  -l     --load-model      [STRING]    model directory" << endl <<
+        "  -o     --output          [STRING]    output directory for the quantized model" << endl << endl;
+}
+
+void print_memory_report(BiLstmTagger &tagger){
+    MemoryReport report;
+    tagger.memory_usage(report);
+    report.add(MemoryReport::ENCODERS, enc::hodor.memory_usage() + enc::morph.memory_usage());
+    report.print(cerr);
+}
+
+// Predicted tags of tree (encoded as X), and top_k labels in MISC if top_k > 0
+void tag_tree(BiLstmTagger &tagger, vector<STRCODE> &X, ConllTree &tree, Output &output, int top_k){
+    vector<vector<int>> pred;
+    if (top_k > 0){
+        TopLabels top;
+        tagger.predict_one(X, pred, top_k, top);
+        tree.assign_top_labels(top, output);
+    }else{
+        tagger.predict_one(X, pred);
+    }
+    tree.assign_tags(pred, output);
 }
 
-void evaluate(shared_ptr<BiLstmTagger> tagger, Output &output, ConllTreebank &tbk, EpochEval &eval){
-    vector<float> losses(output.n_labels.size(), 0.0);
+void evaluate_shard(BiLstmTagger &tagger, Output &output, ConllTreebank &tbk, EpochEval &eval, vector<vector<float>> &losses, int begin, int end){
     vector<STRCODE> X;
-    vector<vector<int>> Y;
+    LabelView Y;
     vector<vector<int>> predictions;
-    for (int i = 0; i < tbk.size(); i++){
-        tbk[i]->to_training_example(X, Y, output);
-        tagger->eval_one(X, Y, predictions, losses);
-        eval.update_losses(losses);
+    for (int i = begin; i < end; i++){
+        tbk.to_training_example(i, X, Y, output);
+        losses[i].assign(output.n_labels.size(), 0.0);   // eval_one accumulates
+        tagger.eval_one(X, Y, predictions, losses[i]);
         assert(Y.size() == predictions.size());
         for (int j = 0; j < Y.size(); j++){
-            assert(Y[j].size() == predictions[j].size());
+            assert(Y.cols == predictions[j].size());
             eval.update(Y[j], predictions[j]);
         }
     }
 }
 
+// Parallel evaluation: taggers are replicas with identical parameters,
+// each one is used by one thread on a contiguous shard of the treebank
+// (a tagger holds the computation graph of the sentence being processed).
+// Partial evaluations are merged in shard order and the losses of sentences
+// are summed in treebank order: the result does not depend on the number of replicas.
+void evaluate(vector<BiLstmTagger*> &taggers, Output &output, ConllTreebank &tbk, EpochEval &eval){
+    int n_shards = std::max(1, std::min<int>(taggers.size(), tbk.size()));
+    vector<EpochEval> partial(n_shards, EpochEval(output));
+    vector<vector<float>> losses(tbk.size());
+    vector<std::thread> threads;
+    for (int s = 1; s < n_shards; s++){
+        threads.push_back(std::thread(evaluate_shard, std::ref(*taggers[s]), std::ref(output), std::ref(tbk), std::ref(partial[s]), std::ref(losses),
+                                      tbk.size() * s / n_shards, tbk.size() * (s + 1) / n_shards));
+    }
+    evaluate_shard(*taggers[0], output, tbk, partial[0], losses, 0, tbk.size() / n_shards);
+    for (std::thread &t : threads){
+        t.join();
+    }
+    for (EpochEval &p : partial){
+        eval.merge(p);
+    }
+    for (vector<float> &l : losses){
+        eval.update_losses(l);
+    }
+}
+
 int main(int argc, char *argv[]){
     srand(rd::Random::SEED);
 
@@ -282,7 +395,22 @@ int main(int argc, char *argv[]){
         {"output", required_argument, 0, 'o'},
         {"load-model", required_argument, 0, 'l'},
         {"hyperparameters", required_argument, 0, 'p'},
-        {"multitask", required_argument, 0, 'M'}};
+        {"multitask", required_argument, 0, 'M'},
+        {"mem-report", no_argument, 0, 'R'},
+        {"min-tokens", required_argument, 0, 'N'},
+        {"patience", required_argument, 0, 'P'},
+        {"eval-every", required_argument, 0, 'E'},
+        {"time-budget", required_argument, 0, 'B'},
+        {"sync-eval", no_argument, 0, 'S'},
+        {"eval-threads", required_argument, 0, 'J'},
+        {"corpus-cache", required_argument, 0, 'C'},
+        {"rnn-threads", required_argument, 0, 'D'},
+        {"window", required_argument, 0, 'W'},
+        {"window-context", required_argument, 0, 'X'},
+        {"max-word-chars", required_argument, 0, 'Y'},
+        {"cache-mb", required_argument, 0, 'K'},
+        {"top-k", required_argument, 0, 'k'},
+        {0, 0, 0, 0}};
 
         int option_index = 0;
 
@@ -300,9 +428,23 @@ int main(int argc, char *argv[]){
         case 'd': options.dev_file = optarg;      break;
         case 'i': options.epochs = atoi(optarg);  break;
         case 'o': options.output_dir = optarg;    break;
-        case 'l': options.output_dir = optarg;    break;
+        case 'l': options.model_dir = optarg;     break;
         case 'p': options.hyper_file = optarg;    break;
         case 'M': output = Output(optarg);        break;
+        case 'R': options.mem_report = true;      break;
+        case 'N': options.min_tokens = atoi(optarg);    break;
+        case 'P': options.patience = atoi(optarg);      break;
+        case 'E': options.eval_every = atoi(optarg);    break;
+        case 'B': options.time_budget = atof(optarg);   break;
+        case 'S': options.async_eval = false;           break;
+        case 'J': options.eval_threads = std::max(1, std::min(MAX_EVAL_THREADS, atoi(optarg))); break;
+        case 'C': options.corpus_cache = optarg;        break;
+        case 'D': options.rnn_threads = std::max(1, atoi(optarg)); break;
+        case 'W': options.window = atoi(optarg);        break;
+        case 'X': options.window_context = atoi(optarg);    break;
+        case 'Y': options.max_word_chars = atoi(optarg);    break;
+        case 'K': options.cache_mb = atof(optarg);          break;
+        case 'k': options.top_k = atoi(optarg);             break;
         default:
             cerr << "unknown option: " << optarg << endl;
             print_help();
@@ -323,8 +465,17 @@ int main(int argc, char *argv[]){
 
         NeuralNetParameters::read_option_file(options.hyper_file, options.params);
 
-        read_conll_corpus(options.train_file, train, true);
-        read_conll_corpus(options.dev_file, dev, false);
+        vector<string> sources{options.train_file, options.dev_file};
+        vector<ConllTreebank*> treebanks{&train, &dev};
+        if (! options.corpus_cache.empty() && read_compiled_corpus(options.corpus_cache, sources, treebanks)){
+            cerr << "Loaded compiled corpus " << options.corpus_cache << endl;
+        }else{
+            read_conll_corpus(options.train_file, train, true);
+            read_conll_corpus(options.dev_file, dev, false);
+            if (! options.corpus_cache.empty()){
+                write_compiled_corpus(options.corpus_cache, sources, treebanks);
+            }
+        }
 
         output.update_bigrams(train);
 
@@ -345,8 +496,24 @@ int main(int argc, char *argv[]){
         train.shuffle();
         train.subset(train_sample, dev.size());
 
+        train.compute_labels(output);
+        train_sample.compute_labels(output);
+        dev.compute_labels(output);
+
         BiLstmTagger tagger(voc_size, output.n_labels, options.params);
 
+        // Averaged model used for evaluation and export, updated in place every epoch
+        RunMode::inference_only = true;
+        BiLstmTagger avg_t(voc_size, output.n_labels, options.params);
+        // Additional copies of avg_t, one per evaluation thread
+        vector<shared_ptr<BiLstmTagger>> replicas;
+        vector<BiLstmTagger*> eval_taggers{&avg_t};
+        for (int i = 1; i < options.eval_threads; i++){
+            replicas.push_back(shared_ptr<BiLstmTagger>(new BiLstmTagger(voc_size, output.n_labels, options.params)));
+            eval_taggers.push_back(replicas.back().get());
+        }
+        RunMode::inference_only = false;
+
 //        vector<shared_ptr<BiLstmTagger>> models;
 //        vector<float> dev_accuracies;
 
@@ -358,32 +525,24 @@ int main(int argc, char *argv[]){
         float best_dev_acc = 0.0;
         float best_dev_loss = 1e20;
         int n_examples = 0;
-        //for (int epoch = 0; epoch < options.epochs || training_accuracy <= 99.6; epoch ++){
-        for (int epoch = 0; epoch < options.epochs || n_examples < 4000000; epoch ++){
-
-            train.shuffle();
-
-            vector<STRCODE> X;
-            vector<vector<int>> Y;
-            for (int i = 0; i < train.size(); i++){
-                train[i]->to_training_example(X, Y, output);
-                tagger.train_one(X, Y);
-                cerr << "\r" << std::setprecision(4) << (i*100.0 / train.size()) << "%";
-
-                n_examples += train[i]->size();
-            }
-
-            shared_ptr<BiLstmTagger> avg_t(tagger.copy());
-            avg_t->average_parameters();
-
+        int n_sentences = 0;
+        std::atomic<int> n_evals_without_improvement(0);
+        Logger clock;
+        double start_time = clock.get_time();
+
+        // Evaluates the averaged snapshot on train sample and dev, exports it if best so far.
+        // Runs in a background thread (unless expert classifiers are used, since
+        // they modify the models): avg_t, log_file and best scores are only
+        // accessed by this function between two calls to wait_for_evaluation().
+        auto evaluate_snapshot = [&](int epoch, int sentences){
             EpochEval eval_train(output);
-            evaluate(avg_t, output, train_sample, eval_train);
+            evaluate(eval_taggers, output, train_sample, eval_train);
 
             //training_accuracy = eval_train.get_acc(0);
 
             EpochEval eval_dev(output);
-            evaluate(avg_t, output, dev, eval_dev);
-            EpochSummary sum(epoch, eval_train, eval_dev);
+            evaluate(eval_taggers, output, dev, eval_dev);
+            EpochSummary sum(epoch, sentences, eval_train, eval_dev);
 
             cerr << "\r";
             sum.print(cout);
@@ -398,27 +557,113 @@ int main(int argc, char *argv[]){
             if (dev_acc > best_dev_acc || (dev_acc == best_dev_acc && dev_loss < best_dev_loss)){
                 best_dev_acc = dev_acc;
                 best_dev_loss = dev_loss;
+                n_evals_without_improvement = 0;
                 output.export_model(options.output_dir);
-                avg_t->export_model(options.output_dir);
+                avg_t.export_model(options.output_dir);
                 ofstream outfile(options.output_dir + "/best_epoch");
                 outfile << epoch << endl;
                 outfile.close();
+            }else{
+                n_evals_without_improvement ++;
             }
 
             if (output.experts){
                 Pair p = eval_dev.most_frequent_error();
                 if(output.add_expert(p.first, p.second)){
                     tagger.add_expert_classifier();
+                    RunMode::inference_only = true;
+                    for (BiLstmTagger *t : eval_taggers){
+                        t->add_expert_classifier();
+                    }
+                    RunMode::inference_only = false;
+                    train.compute_labels(output);
+                    train_sample.compute_labels(output);
+                    dev.compute_labels(output);
+                }
+            }
+        };
+
+        std::thread evaluation;
+        auto wait_for_evaluation = [&](){
+            if (evaluation.joinable()){
+                evaluation.join();
+            }
+        };
+
+        auto evaluate_and_export = [&](int epoch){
+            wait_for_evaluation();  // avg_t is still in use by the previous evaluation
+            for (BiLstmTagger *t : eval_taggers){
+                t->assign_average(tagger);
+            }
+            if (options.async_eval && ! output.experts){
+                evaluation = std::thread(evaluate_snapshot, epoch, n_sentences);
+            }else{
+                evaluate_snapshot(epoch, n_sentences);
+            }
+        };
+
+        auto early_stop = [&](){
+            if (options.patience > 0 && n_evals_without_improvement >= options.patience){
+                cerr << "Early stopping: no improvement on dev for " << options.patience << " evaluations" << endl;
+                return true;
+            }
+            return false;
+        };
+
+        auto out_of_time = [&](){
+            return options.time_budget > 0 && clock.get_time() - start_time > options.time_budget;
+        };
+
+        bool stop = false;
+        //for (int epoch = 0; epoch < options.epochs || training_accuracy <= 99.6; epoch ++){
+        for (int epoch = 0; ! stop && (epoch < options.epochs || n_examples < options.min_tokens); epoch ++){
+
+            train.shuffle();
+
+            vector<STRCODE> X;
+            LabelView Y;
+            bool evaluated = false;
+            for (int i = 0; i < train.size(); i++){
+                train.to_training_example(i, X, Y, output);
+                tagger.train_one(X, Y);
+                cerr << "\r" << std::setprecision(4) << (i*100.0 / train.size()) << "%";
+
+                n_examples += train.sentence_size(i);
+                n_sentences ++;
+                evaluated = false;
+
+                if (options.eval_every > 0 && n_sentences % options.eval_every == 0){
+                    evaluate_and_export(epoch);
+                    evaluated = true;
+                }
+                if (early_stop()){  // asynchronous results are taken into account when ready
+                    stop = true;
+                    break;
                 }
+                if (out_of_time()){
+                    cerr << "\rTime budget exhausted (" << options.time_budget << "s)" << endl;
+                    stop = true;
+                    break;
+                }
+            }
+
+            if (! evaluated){
+                evaluate_and_export(epoch);
             }
+            stop = stop || early_stop();
 
             if (epoch > 100){
                 break;
             }
         }
 
+        wait_for_evaluation();
         log_file.close();
 
+        if (options.mem_report){
+            print_memory_report(tagger);
+        }
+
 //        int argmax = 0;
 //        for (int i = 0; i < dev_accuracies.size(); i++){
 //            if (dev_accuracies[i] >= dev_accuracies[argmax]){
@@ -428,23 +673,55 @@ int main(int argc, char *argv[]){
 //        models[argmax]->export_model(options.output_dir);
 //        output.export_model(options.output_dir);
 
+    }else if (options.mode == Options::QUANTIZE){
+        if (! options.check()){
+            exit(1);
+        }
+        enc::import_encoders(options.model_dir);
+        output.import_model(options.model_dir);
+        NeuralNetParameters::read_option_file(options.model_dir + "/hyperparameters", options.params);
+        output.get_output_sizes();
+        RunMode::inference_only = true;
+        BiLstmTagger tagger(enc::hodor.size(enc::TOK), output.n_labels, options.params);
+        tagger.import_model(options.model_dir);
+
+        MemoryReport before;
+        tagger.memory_usage(before);
+        tagger.quantize();
+        MemoryReport after;
+        tagger.memory_usage(after);
+        cerr << "Parameters: " << before.bytes[MemoryReport::PARAMETERS] / (1024.0 * 1024.0) << " MB -> "
+             << after.bytes[MemoryReport::PARAMETERS] / (1024.0 * 1024.0) << " MB" << endl;
+
+        mkdir(options.output_dir.c_str(), S_IRUSR | S_IWUSR | S_IXUSR);
+        output.export_model(options.output_dir);
+        tagger.export_model(options.output_dir);
+
     }else{
         assert(options.mode == Options::TEST);
 
 
-        enc::import_encoders(options.output_dir);
+        enc::import_encoders(options.model_dir);
         int voc_size = enc::hodor.size(enc::TOK);
 
-        output.import_model(options.output_dir);
+        output.import_model(options.model_dir);
 
-        NeuralNetParameters::read_option_file(options.output_dir + "/hyperparameters", options.params);
+        NeuralNetParameters::read_option_file(options.model_dir + "/hyperparameters", options.params);
         cerr << "Hyperparameters" << endl;
         options.params.print(cerr);
         cerr << endl;
 
         output.get_output_sizes();
+        RunMode::inference_only = true;   // no gradient / averaging buffers
         BiLstmTagger tagger(voc_size, output.n_labels, options.params);
-        tagger.import_model(options.output_dir);
+        tagger.import_model(options.model_dir);
+        tagger.set_rnn_threads(options.rnn_threads);
+        tagger.set_window(options.window, options.window_context, options.max_word_chars);
+        shared_ptr<PredictionCache> cache;
+        if (options.cache_mb > 0){
+            cache = shared_ptr<PredictionCache>(new PredictionCache(options.cache_mb * 1024 * 1024));
+            tagger.set_prediction_cache(cache);
+        }
 
         if (optind < argc){
             for (int file_i = optind; file_i < argc; file_i ++){
@@ -466,13 +743,13 @@ int main(int argc, char *argv[]){
                     vector<ConllToken> ctokens;
                     str_to_conlltokens(tokens, ctokens);
                     ConllTree tree(ctokens);
+                    ConllTreebank sentence;
+                    sentence.add_tree(tree);
 
                     vector<STRCODE> X;
-                    vector<vector<int>> gold;
-                    vector<vector<int>> pred;
-                    tree.to_training_example(X, gold, output);
-                    tagger.predict_one(X, pred);
-                    tree.assign_tags(pred, output);
+                    LabelView gold;
+                    sentence.to_training_example(0, X, gold, output);
+                    tag_tree(tagger, X, tree, output, options.top_k);
                     cout << tree << endl;
                 }
             }
@@ -482,15 +759,22 @@ int main(int argc, char *argv[]){
             ConllTreebank test;
             read_conll_corpus(options.test_file, test, false);
 
+            vector<STRCODE> X;
+            LabelView gold;
             for (int i = 0; i < test.size(); i++){
-                vector<STRCODE> X;
-                vector<vector<int>> gold;
-                vector<vector<int>> pred;
-                test[i]->to_training_example(X, gold, output);
-                tagger.predict_one(X, pred);
-                test[i]->assign_tags(pred, output);
+                test.to_training_example(i, X, gold, output);
+                ConllTree tree = test.tree(i);
+                tag_tree(tagger, X, tree, output, options.top_k);
+                cout << tree << endl;
             }
-            cout << test;
+        }
+
+        if (cache != nullptr){
+            cerr << "Prediction cache: " << cache->hits << " hits, " << cache->misses << " misses, "
+                 << cache->evictions << " evictions" << endl;
+        }
+        if (options.mem_report){
+            print_memory_report(tagger);
         }
     }
 }
@@ -3,9 +3,9 @@
 
 
 
-CharBiRnnFeatureExtractor::CharBiRnnFeatureExtractor(){}
+CharBiRnnFeatureExtractor::CharBiRnnFeatureExtractor():max_chars(0){}
 CharBiRnnFeatureExtractor::CharBiRnnFeatureExtractor(CharRnnParameters *nn_parameters)
-    : params(nn_parameters){
+    : params(nn_parameters), max_chars(0){
     encoder = SequenceEncoder(nn_parameters->crnn);
     vector<int> input_sizes{params->dim_char};
 
@@ -21,12 +21,19 @@ CharBiRnnFeatureExtractor::CharBiRnnFeatureExtractor(CharRnnParameters *nn_param
             (*layers[i])[j]->get_params(parameters);
         }
     }
+
+    vector<MultipleLinearLayer*> gates;
+    for (int i = 0; i < layers.size(); i++){
+        layers[i]->get_gates(gates);
+    }
+    projection.set_gates(gates);
 }
 
 CharBiRnnFeatureExtractor::~CharBiRnnFeatureExtractor(){}
 
 void CharBiRnnFeatureExtractor::precompute_lstm_char(){
     cerr << "Precomputing char-lstm for known words" << endl;
+    precomputed_embeddings.clear();
     vector<STRCODE> fake_buffer; // contain the list of tokens in vocabulary
     for (STRCODE i = 0; i < enc::hodor.size(enc::TOK); i++){
         //const vector<STRCODE> morph{i};
@@ -62,6 +69,9 @@ void CharBiRnnFeatureExtractor::build_computation_graph(vector<STRCODE> &buffer,
         add_init_node(depth);
     }
 
+    projection.clear();
+    InputProjection *proj = RunMode::input_projection ? &projection : nullptr;
+
     for (int w = 0; w < input.size(); w++){
         STRCODE tokcode = buffer[w];
 
@@ -75,11 +85,16 @@ void CharBiRnnFeatureExtractor::build_computation_graph(vector<STRCODE> &buffer,
         }else{
             vector<int> sequence;
             encoder(tokcode, sequence);
+            if (max_chars > 0 && sequence.size() > max_chars){
+                sequence.erase(sequence.begin() + max_chars / 2, sequence.end() - (max_chars - max_chars / 2));
+            }
 
             // Character drop out
-            for (int c = 0; c < sequence.size(); c++){
-                if (rd::random() < CHAR_DROPOUT){
-                    sequence[c] = enc::UNKNOWN;
+            if (train_time){
+                for (int c = 0; c < sequence.size(); c++){
+                    if (rd::random() < CHAR_DROPOUT){
+                        sequence[c] = enc::UNKNOWN;
+                    }
                 }
             }
 
@@ -91,6 +106,13 @@ void CharBiRnnFeatureExtractor::build_computation_graph(vector<STRCODE> &buffer,
                 input[w].push_back(proxy);
             }
 
+            vector<int> t(sequence.size(), 0);     // columns of the characters in the projection
+            if (proj != nullptr){
+                for (int c = 0; c < sequence.size(); c++){
+                    t[c] = projection.add_timestep(input[w][c]);
+                }
+            }
+
             states[w] = {vector<shared_ptr<AbstractNeuralNode>>(sequence.size()),
                          vector<shared_ptr<AbstractNeuralNode>>(sequence.size())};
 
@@ -98,25 +120,25 @@ void CharBiRnnFeatureExtractor::build_computation_graph(vector<STRCODE> &buffer,
             states[w][depth][0] = shared_ptr<AbstractNeuralNode>(
                         new LstmNode(params->dim_char_based_embeddings,
                                      init_nodes[depth],
-                                     input[w][0],*layers[depth]));
+                                     input[w][0],*layers[depth], proj, t[0]));
 
             for (int c = 1; c < sequence.size(); c++){
                 states[w][depth][c] = shared_ptr<AbstractNeuralNode>(
                             new LstmNode(params->dim_char_based_embeddings,
                                          states[w][depth][c-1],
-                            input[w][c], *layers[depth]));
+                            input[w][c], *layers[depth], proj, t[c]));
             }
             depth = 1;
             states[w][depth].back() = shared_ptr<AbstractNeuralNode>(
                         new LstmNode(params->dim_char_based_embeddings,
                                      init_nodes[depth],
-                                     input[w].back(), *layers[depth]));
+                                     input[w].back(), *layers[depth], proj, t.back()));
 
             for (int c = sequence.size()-2; c >= 0; c--){
                 states[w][depth][c] = shared_ptr<AbstractNeuralNode>(
                             new LstmNode(params->dim_char_based_embeddings,
                                          states[w][depth][c+1],
-                            input[w][c], *layers[depth]));
+                            input[w][c], *layers[depth], proj, t[c]));
             }
         }
     }
@@ -136,14 +158,36 @@ void CharBiRnnFeatureExtractor::fprop(){
     for (int i = 0; i < init_nodes.size(); i++){
         init_nodes[i]->fprop();
     }
-    for (int w = 0; w < states.size(); w++){
-        for (int c = 0; c < states[w][0].size(); c++){
-            states[w][0][c]->fprop();
+    projection.fprop();
+    if (pool == nullptr){
+        for (int w = 0; w < states.size(); w++){
+            for (int c = 0; c < states[w][0].size(); c++){
+                states[w][0][c]->fprop();
+            }
+            for (int c = states[w][1].size() -1; c >= 0; c--){
+                states[w][1][c]->fprop();
+            }
         }
-        for (int c = states[w][1].size() -1; c >= 0; c--){
-            states[w][1][c]->fprop();
+        return;
+    }
+    // Words are independent, and so are both directions of a word
+    vector<std::function<void()>> tasks;
+    for (int w = 0; w < states.size(); w++){
+        if (input[w].empty()){     // precomputed embeddings (constant nodes)
+            continue;
         }
+        tasks.push_back([this, w](){
+            for (int c = 0; c < states[w][0].size(); c++){
+                states[w][0][c]->fprop();
+            }
+        });
+        tasks.push_back([this, w](){
+            for (int c = states[w][1].size() -1; c >= 0; c--){
+                states[w][1][c]->fprop();
+            }
+        });
     }
+    pool->run(tasks);
 }
 
 void CharBiRnnFeatureExtractor::bprop(){
@@ -155,6 +199,7 @@ void CharBiRnnFeatureExtractor::bprop(){
             states[w][1][c]->bprop();
         }
     }
+    projection.bprop();
     for (int i = 0; i < init_nodes.size(); i++){
         init_nodes[i]->bprop();
     }
@@ -206,6 +251,14 @@ void CharBiRnnFeatureExtractor::assign_parameters(CharBiRnnFeatureExtractor &oth
     }
 }
 
+void CharBiRnnFeatureExtractor::assign_average(CharBiRnnFeatureExtractor &other, double T){
+    assert(parameters.size() == other.parameters.size());
+    for (int i = 0; i < parameters.size(); i++){
+        parameters[i]->assign_average(other.parameters[i], T);
+    }
+    lu.assign_average(other.lu, T);
+}
+
 void CharBiRnnFeatureExtractor::average_weights(int T){
     for (int i = 0; i < parameters.size(); i++){
         parameters[i]->average(T);
@@ -239,6 +292,45 @@ void CharBiRnnFeatureExtractor::reset_gradient_history(){
     }
 }
 
+void CharBiRnnFeatureExtractor::set_optimizer(const Optimizer *optimizer){
+    for (int i = 0; i < parameters.size(); i++){
+        parameters[i]->optimizer = optimizer;
+    }
+    lu.optimizer = optimizer;
+}
+
+void CharBiRnnFeatureExtractor::set_fast_activations(bool fast){
+    for (int i = 0; i < layers.size(); i++){
+        layers[i]->set_fast_activations(fast);
+    }
+}
+
+void CharBiRnnFeatureExtractor::set_thread_pool(shared_ptr<ThreadPool> pool){
+    this->pool = pool;
+}
+
+void CharBiRnnFeatureExtractor::set_max_chars(int n){
+    max_chars = n;
+}
+
+void CharBiRnnFeatureExtractor::memory_usage(MemoryReport &report){
+    lu.memory_usage(report);
+    for (int i = 0; i < parameters.size(); i++){
+        parameters[i]->memory_usage(report);
+    }
+    report.add(MemoryReport::ENCODERS, encoder.memory_usage());
+    projection.memory_usage(report);
+
+    size_t bytes = precomputed_embeddings.capacity() * sizeof(vector<Vec>);
+    for (vector<Vec> &word : precomputed_embeddings){
+        bytes += word.capacity() * sizeof(Vec);
+        for (Vec &x : word){
+            bytes += x.size() * sizeof(double);
+        }
+    }
+    report.add(MemoryReport::CHAR_CACHE, bytes);
+}
+
 
 
 //////////////////////////////////////////////////////////////////////////////
@@ -280,6 +372,18 @@ BiRnnFeatureExtractor::BiRnnFeatureExtractor(NeuralNetParameters *nn_parameters,
             (*layers[i])[j]->get_params(parameters);
         }
     }
+    for (int i = 0; i < parameters.size(); i++){
+        parameters[i]->optimizer = &params->optimizer;
+    }
+
+    projections.resize((layers.size() + 1) / 2);
+    for (int i = 0; i < projections.size(); i++){
+        vector<MultipleLinearLayer*> gates;
+        for (int d = 2 * i; d < std::min<int>(2 * i + 2, layers.size()); d++){
+            layers[d]->get_gates(gates);
+        }
+        projections[i].set_gates(gates);
+    }
 
 //    out_of_bounds = Vec::Zero(params->rnn.hidden_size);
 //    out_of_bounds_d = Vec::Zero(params->rnn.hidden_size);
@@ -287,7 +391,9 @@ BiRnnFeatureExtractor::BiRnnFeatureExtractor(NeuralNetParameters *nn_parameters,
     if (params->rnn.crnn.crnn > 0){
         char_rnn = CharBiRnnFeatureExtractor(& params->rnn.crnn);
         char_rnn.init_encoders();
+        char_rnn.set_optimizer(&params->optimizer);
     }
+    set_fast_activations(params->fast_activations);
 
 
 //    if (params->rnn.auxiliary_task){
@@ -320,7 +426,9 @@ BiRnnFeatureExtractor::~BiRnnFeatureExtractor(){}
 void BiRnnFeatureExtractor::precompute_char_lstm(){
     train_time = false;
     parse_time = true;
-    char_rnn.precompute_lstm_char();
+    if (params->rnn.crnn.crnn > 0){
+        char_rnn.precompute_lstm_char();
+    }
 }
 
 void BiRnnFeatureExtractor::build_computation_graph(vector<STRCODE> &buffer){
@@ -379,32 +487,50 @@ void BiRnnFeatureExtractor::build_computation_graph(vector<STRCODE> &buffer){
         add_init_node(i);
     }
 
+    // Timestep i of a projection is token i
+    for (int i = 0; i < projections.size(); i++){
+        projections[i].clear();
+    }
+    InputProjection *proj = nullptr;
+    if (RunMode::input_projection){
+        proj = &projections[0];
+        for (int i = 0; i < buffer.size(); i++){
+            proj->add_timestep(input[i]);
+        }
+    }
+
     depth = 0;
-    states[depth][0]=  shared_ptr<AbstractNeuralNode>(get_recurrent_node(init_nodes[depth], input[0], *layers[depth]));
+    states[depth][0]=  shared_ptr<AbstractNeuralNode>(get_recurrent_node(init_nodes[depth], input[0], *layers[depth], proj, 0));
     for (int i = 1; i < buffer.size(); i++){
-        states[depth][i]= shared_ptr<AbstractNeuralNode>(get_recurrent_node(states[depth][i-1], input[i], *layers[depth]));
+        states[depth][i]= shared_ptr<AbstractNeuralNode>(get_recurrent_node(states[depth][i-1], input[i], *layers[depth], proj, i));
     }
 
     depth = 1;
-    states[depth].back() = shared_ptr<AbstractNeuralNode>(get_recurrent_node(init_nodes[depth], input.back(), *layers[depth]));
+    states[depth].back() = shared_ptr<AbstractNeuralNode>(get_recurrent_node(init_nodes[depth], input.back(), *layers[depth], proj, buffer.size()-1));
     for (int i = buffer.size()-2; i >=0 ; i--){
-        states[depth][i] = shared_ptr<AbstractNeuralNode>(get_recurrent_node(states[depth][i+1], input[i], *layers[depth]));
+        states[depth][i] = shared_ptr<AbstractNeuralNode>(get_recurrent_node(states[depth][i+1], input[i], *layers[depth], proj, i));
     }
 
     for (depth = 2; depth < params->rnn.depth; depth++){
         if (depth % 2 == 0){
+            if (RunMode::input_projection){
+                proj = &projections[depth / 2];
+                for (int i = 0; i < buffer.size(); i++){
+                    proj->add_timestep({states[depth-1][i], states[depth-2][i]});
+                }
+            }
             vector<shared_ptr<AbstractNeuralNode>> rnn_in{states[depth-1][0], states[depth-2][0]};
-            states[depth][0] = shared_ptr<AbstractNeuralNode>(get_recurrent_node(init_nodes[depth], rnn_in, *layers[depth]));
+            states[depth][0] = shared_ptr<AbstractNeuralNode>(get_recurrent_node(init_nodes[depth], rnn_in, *layers[depth], proj, 0));
             for (int i = 1; i < buffer.size(); i++){
                 rnn_in = {states[depth-1][i], states[depth-2][i]};
-                states[depth][i]= shared_ptr<AbstractNeuralNode>(get_recurrent_node(states[depth][i-1], rnn_in, *layers[depth]));
+                states[depth][i]= shared_ptr<AbstractNeuralNode>(get_recurrent_node(states[depth][i-1], rnn_in, *layers[depth], proj, i));
             }
         }else{
             vector<shared_ptr<AbstractNeuralNode>> rnn_in{states[depth-2].back(), states[depth-3].back()};
-            states[depth].back() = shared_ptr<AbstractNeuralNode>(get_recurrent_node(init_nodes[depth], rnn_in, *layers[depth]));
+            states[depth].back() = shared_ptr<AbstractNeuralNode>(get_recurrent_node(init_nodes[depth], rnn_in, *layers[depth], proj, buffer.size()-1));
             for (int i = buffer.size()-2; i >=0 ; i--){
                 rnn_in = {states[depth-2][i], states[depth-3][i]};
-                states[depth][i] = shared_ptr<AbstractNeuralNode>(get_recurrent_node(states[depth][i+1], rnn_in, *layers[depth]));
+                states[depth][i] = shared_ptr<AbstractNeuralNode>(get_recurrent_node(states[depth][i+1], rnn_in, *layers[depth], proj, i));
             }
         }
     }
@@ -438,17 +564,18 @@ void BiRnnFeatureExtractor::add_init_node(int depth){
 AbstractNeuralNode* BiRnnFeatureExtractor::get_recurrent_node(
         shared_ptr<AbstractNeuralNode> &pred,
         vector<shared_ptr<AbstractNeuralNode> > &input_nodes,
-        RecurrentLayerWrapper &l){
+        RecurrentLayerWrapper &l,
+        InputProjection *projection, int t){
 
     switch(params->rnn.cell_type){
     case RecurrentLayerWrapper::GRU:
-        return new GruNode(params->rnn.hidden_size, pred, input_nodes, l);
+        return new GruNode(params->rnn.hidden_size, pred, input_nodes, l, projection, t);
     case RecurrentLayerWrapper::RNN:
-        return new RnnNode(params->rnn.hidden_size, pred, input_nodes, l);
+        return new RnnNode(params->rnn.hidden_size, pred, input_nodes, l, projection, t);
     case RecurrentLayerWrapper::LSTM:
-        return new LstmNode(params->rnn.hidden_size, pred, input_nodes, l);
+        return new LstmNode(params->rnn.hidden_size, pred, input_nodes, l, projection, t);
     case RecurrentLayerWrapper::LN_LSTM:
-        return new LnLstmNode(params->rnn.hidden_size, pred, input_nodes, l);
+        return new LnLstmNode(params->rnn.hidden_size, pred, input_nodes, l, projection, t);
     default:
         assert(false);
     }
@@ -465,15 +592,34 @@ void BiRnnFeatureExtractor::fprop(){
         init_nodes[i]->fprop();
     }
 
-    for (int d = 0; d < states.size(); d++){
-        if (d % 2 == 0){
-            for (int i = 0; i < states[d].size(); i++){
-                states[d][i]->fprop();
-            }
+    auto forward = [this](int d){
+        for (int i = 0; i < states[d].size(); i++){
+            states[d][i]->fprop();
+        }
+    };
+    auto backward = [this](int d){
+        for (int i = states[d].size() -1; i >= 0; i--){
+            states[d][i]->fprop();
+        }
+    };
+    // Layers d and d+1 both need the whole of layers d-2 and d-1 (timestep 0
+    // of the forward layer needs the last state computed by the backward
+    // one), so a pair of layers can only start when the previous pair is done.
+    for (int d = 0; d < states.size(); d += 2){
+        InputProjection &projection = projections[d / 2];
+        if (d + 1 == states.size()){
+            projection.fprop();
+            forward(d);
+        }else if (pool == nullptr){
+            projection.fprop();
+            forward(d);
+            backward(d + 1);
         }else{
-            for (int i = states[d].size() -1; i >= 0; i--){
-                states[d][i]->fprop();
-            }
+            // gates of layer d, then gates of layer d+1: each task projects its own
+            int half = projection.gates.size() / 2;
+            projection.gather_input();
+            pool->run({[&](){ projection.project(0, half); forward(d); },
+                       [&](){ projection.project(half, projection.gates.size()); backward(d + 1); }});
         }
     }
 }
@@ -489,6 +635,9 @@ void BiRnnFeatureExtractor::bprop(){
                 states[d][i]->bprop();
             }
         }
+        if (d % 2 == 0){
+            projections[d / 2].bprop();
+        }
     }
     for (int i = 0; i < init_nodes.size(); i++){
         init_nodes[i]->bprop();
@@ -587,6 +736,16 @@ void BiRnnFeatureExtractor::copy_char_birnn(BiRnnFeatureExtractor &other){
     }
 }
 
+void BiRnnFeatureExtractor::assign_average(BiRnnFeatureExtractor &other, double T){
+    assert(parameters.size() == other.parameters.size());
+    for (int i = 0; i < parameters.size(); i++){
+        parameters[i]->assign_average(other.parameters[i], T);
+    }
+    if (params->rnn.crnn.crnn > 0){
+        char_rnn.assign_average(other.char_rnn, T);
+    }
+}
+
 void BiRnnFeatureExtractor::average_weights(int T){
     for (int i = 0; i < parameters.size(); i++){
         parameters[i]->average(T);
@@ -632,6 +791,36 @@ void BiRnnFeatureExtractor::load_parameters(const string &outdir){
 //    }
 }
 
+void BiRnnFeatureExtractor::memory_usage(MemoryReport &report){
+    for (int i = 0; i < parameters.size(); i++){
+        parameters[i]->memory_usage(report);
+    }
+    if (params->rnn.crnn.crnn){
+        char_rnn.memory_usage(report);
+    }
+    for (int i = 0; i < projections.size(); i++){
+        projections[i].memory_usage(report);
+    }
+}
+
+void BiRnnFeatureExtractor::set_fast_activations(bool fast){
+    for (int i = 0; i < layers.size(); i++){
+        layers[i]->set_fast_activations(fast);
+    }
+    if (params->rnn.crnn.crnn){
+        char_rnn.set_fast_activations(fast);
+    }
+}
+
+void BiRnnFeatureExtractor::set_threads(int n){
+    pool = n > 1 ? shared_ptr<ThreadPool>(new ThreadPool(n)) : nullptr;
+    char_rnn.set_thread_pool(pool);
+}
+
+void BiRnnFeatureExtractor::set_max_chars(int n){
+    char_rnn.set_max_chars(n);
+}
+
 /*
 void BiRnnFeatureExtractor::auxiliary_task_summary(ostream &os){
     os << "Auxiliary tasks summary:" << endl;
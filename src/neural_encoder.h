@@ -51,6 +51,12 @@ class CharBiRnnFeatureExtractor{
     // input (lookup) nodes
     vector<NodeMatrix> input; // input[word][depth][char]
 
+    // input side of both directions for all the characters of the sentence (if RunMode::input_projection)
+    InputProjection projection;
+
+    // forward pass of the words (one task per word and direction) if not null
+    shared_ptr<ThreadPool> pool;
+
     // hyperparameters and lookup tables
     LookupTable lu;
     CharRnnParameters *params;
@@ -61,6 +67,8 @@ class CharBiRnnFeatureExtractor{
 
     vector<vector<Vec>> precomputed_embeddings;
 
+    int max_chars;  // longer words keep their first and last characters (0: no limit)
+
     static const int CHAR_DROPOUT = 0.2;
 
 public:
@@ -82,11 +90,17 @@ public:
     int size();
     void copy_encoders(CharBiRnnFeatureExtractor &other);
     void assign_parameters(CharBiRnnFeatureExtractor &other);
+    void assign_average(CharBiRnnFeatureExtractor &other, double T);
     void average_weights(int T);
     void get_parameters(vector<shared_ptr<Parameter>> &weights);
     void export_model(const string &outdir);
     void load_parameters(const string &outdir);
     void reset_gradient_history();
+    void memory_usage(MemoryReport &report);
+    void set_optimizer(const Optimizer *optimizer);
+    void set_fast_activations(bool fast);
+    void set_thread_pool(shared_ptr<ThreadPool> pool);
+    void set_max_chars(int n);
 };
 
 
@@ -105,6 +119,13 @@ class BiRnnFeatureExtractor{
     //vector<vector<shared_ptr<AbstractNeuralNode>>> input;
     NodeMatrix input;
 
+    // projections[d/2]: input side of layers d and d+1 (same inputs), if RunMode::input_projection
+    vector<InputProjection> projections;
+
+    // forward pass of both directions of a layer (input projection of
+    // their gates included) run concurrently if not null
+    shared_ptr<ThreadPool> pool;
+
     // hyperparameters and lookup tables
     LookupTable *lu;
     NeuralNetParameters *params;
@@ -147,7 +168,8 @@ public:
 
     AbstractNeuralNode* get_recurrent_node(shared_ptr<AbstractNeuralNode> &pred,
                                            vector<shared_ptr<AbstractNeuralNode>> &input_nodes,
-                                           RecurrentLayerWrapper &l);
+                                           RecurrentLayerWrapper &l,
+                                           InputProjection *projection, int t);
 
     void fprop();
 
@@ -164,6 +186,7 @@ public:
 
     void assign_parameters(BiRnnFeatureExtractor &other);
     void copy_char_birnn(BiRnnFeatureExtractor &other);
+    void assign_average(BiRnnFeatureExtractor &other, double T);
 
     void average_weights(int T);
 
@@ -173,6 +196,18 @@ public:
 
     void load_parameters(const string &outdir);
 
+    void memory_usage(MemoryReport &report);
+
+    void set_fast_activations(bool fast);
+
+    // Threads used by fprop for a single sentence (n <= 1: sequential).
+    // The backward pass is always sequential: both directions of a layer
+    // accumulate gradients into the same input nodes.
+    void set_threads(int n);
+
+    // Number of characters of a word read by the char-based encoder (0: no limit)
+    void set_max_chars(int n);
+
     /*
     void auxiliary_task_summary(ostream &os);
     void add_aux_graph(vector<STRCODE> &buffer, vector<vector<int>> &targets, bool aux_only);
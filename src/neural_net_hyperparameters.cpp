@@ -24,7 +24,8 @@ NeuralNetParameters::NeuralNetParameters():
     gaussian_noise_eta(0.1),
     gaussian_noise(true),
     gradient_clipping(true),
-    soft_clipping(false){}
+    soft_clipping(false),
+    fast_activations(false){}
 
 void NeuralNetParameters::print(ostream &os){
     os << "learning rate\t"       << learning_rate << endl;
@@ -33,6 +34,10 @@ void NeuralNetParameters::print(ostream &os){
     os << "clip value\t"          << clip_value << endl;
     os << "gaussian noise\t"      << gaussian_noise << endl;
     os << "gaussian noise eta\t"  << gaussian_noise_eta << endl;
+    os << "optimizer\t"           << optimizer.type << endl;
+    os << "beta1\t"               << optimizer.beta1 << endl;
+    os << "beta2\t"               << optimizer.beta2 << endl;
+    os << "epsilon\t"             << optimizer.epsilon << endl;
     os << "hidden layers\t"       << topology.n_hidden_layers << endl;
     os << "size hidden layers\t"  << topology.size_hidden_layers << endl;
     os << "embedding sizes\t";
@@ -47,6 +52,7 @@ void NeuralNetParameters::print(ostream &os){
     os << "char rnn\t" << rnn.crnn.crnn << endl;
     os << "char embedding size\t" << rnn.crnn.dim_char << endl;
     os << "char based embedding size\t" << rnn.crnn.dim_char_based_embeddings << endl;
+    os << "fast activations\t" << fast_activations << endl;
 //    os << "auxiliary task\t" << rnn.auxiliary_task << endl;
 //    os << "auxiliary task max idx\t" << rnn.auxiliary_task_max_target << endl;
 //    os << "voc sizes\t";
@@ -64,7 +70,9 @@ void NeuralNetParameters::read_option_file(const string &filename, NeuralNetPara
           CHAR_BIRNN, CHAR_EMBEDDING_SIZE, CHAR_BASED_EMBEDDING_SIZE,
           GAUSSIAN_NOISE_ETA,
          AUX_TASK, AUX_TASK_IDX,
-         VOC_SIZES};
+         VOC_SIZES,
+         OPTIMIZER, BETA1, BETA2, EPSILON,
+         FAST_ACTIVATIONS};
     unordered_map<string,int> dictionary{
         {"learning rate", LEARNING_RATE},
         {"decrease constant", DECREASE_CONSTANT},
@@ -85,7 +93,12 @@ void NeuralNetParameters::read_option_file(const string &filename, NeuralNetPara
         {"gaussian noise eta", GAUSSIAN_NOISE_ETA},
         {"auxiliary task", AUX_TASK},
         {"auxiliary task max idx", AUX_TASK_IDX},
-        {"voc sizes", VOC_SIZES}
+        {"voc sizes", VOC_SIZES},
+        {"optimizer", OPTIMIZER},
+        {"beta1", BETA1},
+        {"beta2", BETA2},
+        {"epsilon", EPSILON},
+        {"fast activations", FAST_ACTIVATIONS}
     };
     ifstream is(filename);
     string buffer;
@@ -103,6 +116,10 @@ void NeuralNetParameters::read_option_file(const string &filename, NeuralNetPara
             case CLIP_VALUE:        p.clip_value = stod(tokens[1]);                 break;
             case GAUSSIAN_NOISE:    p.gaussian_noise = stoi(tokens[1]);             break;
             case GAUSSIAN_NOISE_ETA:p.gaussian_noise_eta = stod(tokens[1]);         break;
+            case OPTIMIZER:         p.optimizer.type = stoi(tokens[1]);             break;
+            case BETA1:             p.optimizer.beta1 = stod(tokens[1]);            break;
+            case BETA2:             p.optimizer.beta2 = stod(tokens[1]);            break;
+            case EPSILON:           p.optimizer.epsilon = stod(tokens[1]);          break;
             case HIDDEN_LAYERS:     p.topology.n_hidden_layers = stoi(tokens[1]);   break;
             case SIZE_HIDDEN:       p.topology.size_hidden_layers = stoi(tokens[1]);break;
             case EMBEDDING_SIZE:{
@@ -131,6 +148,7 @@ void NeuralNetParameters::read_option_file(const string &filename, NeuralNetPara
             case CHAR_BIRNN: p.rnn.crnn.crnn = stoi(tokens[1]);         break;
             case CHAR_EMBEDDING_SIZE: p.rnn.crnn.dim_char = stoi(tokens[1]);      break;
             case CHAR_BASED_EMBEDDING_SIZE: p.rnn.crnn.dim_char_based_embeddings = stoi(tokens[1]); break;
+            case FAST_ACTIVATIONS: p.fast_activations = stoi(tokens[1]); break;
 //            case AUX_TASK: p.rnn.auxiliary_task = stoi(tokens[1]);                break;
 //            case AUX_TASK_IDX: p.rnn.auxiliary_task_max_target = stoi(tokens[1]); break;
             default:
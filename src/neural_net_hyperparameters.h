@@ -45,6 +45,8 @@ struct NeuralNetParameters{
     bool gaussian_noise;
     bool gradient_clipping;
     bool soft_clipping;
+    bool fast_activations;  // vectorized approximations of exp / sigmoid / tanh (see activations.h)
+    Optimizer optimizer;
     //bool rnn_feature_extractor;
 
     //vector<int> voc_sizes;
@@ -0,0 +1,340 @@
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <map>
+#include <cstdio>
+
+#include "conll_utils.h"
+#include "bilstm_tagger.h"
+#include "logger.h"
+#include "synthetic_corpus.h"
+#include "neural_net_hyperparameters.h"
+
+/////////////////////////////////////////////////////////////////
+///
+/// End-to-end throughput regression harness.
+///
+/// Generates a synthetic treebank, trains the tagger on N
+/// sentences, exports / reloads the model, tags M sentences
+/// and records throughputs, timings and peak RSS.
+/// Results can be compared with a stored JSON baseline:
+/// the program exits with status 1 if any metric regresses
+/// by more than the tolerance.
+///
+/////////////////////////////////////////////////////////////////
+
+using namespace std;
+
+typedef std::map<string, double> Metrics;
+
+// Metrics where higher is better (throughputs, accuracy, cache hit rate),
+// all others are timings or memory
+bool higher_is_better(const string &metric){
+    return metric.find("per_sec") != string::npos || metric.find("accuracy") != string::npos
+            || metric.find("hit_rate") != string::npos;
+}
+
+void write_json(ostream &os, Metrics &metrics){
+    os << "{" << endl;
+    int i = 0;
+    for (auto &it : metrics){
+        os << "  \"" << it.first << "\": " << std::setprecision(10) << it.second;
+        if (++i < metrics.size()){
+            os << ",";
+        }
+        os << endl;
+    }
+    os << "}" << endl;
+}
+
+// Reads a flat JSON object of numbers as written by write_json
+bool read_json(const string &filename, Metrics &metrics){
+    ifstream in(filename);
+    if (! in.is_open()){
+        return false;
+    }
+    string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    size_t pos = 0;
+    while ((pos = content.find('"', pos)) != string::npos){
+        size_t end = content.find('"', pos + 1);
+        size_t colon = content.find(':', end);
+        if (end == string::npos || colon == string::npos){
+            return false;
+        }
+        string key = content.substr(pos + 1, end - pos - 1);
+        metrics[key] = strtod(content.c_str() + colon + 1, nullptr);
+        pos = colon;
+    }
+    return true;
+}
+
+bool compare_to_baseline(Metrics &results, Metrics &baseline, double tolerance){
+    bool ok = true;
+    for (auto &it : baseline){
+        auto res = results.find(it.first);
+        if (res == results.end()){
+            continue;
+        }
+        double ref = it.second;
+        double val = res->second;
+        bool regression = higher_is_better(it.first) ? val < ref * (1.0 - tolerance)
+                                                     : val > ref * (1.0 + tolerance);
+        cerr << (regression ? "REGRESSION  " : "ok          ")
+             << it.first << " " << val << " (baseline " << ref << ")" << endl;
+        ok = ok && ! regression;
+    }
+    return ok;
+}
+
+int remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftwbuf){
+    return remove(path);
+}
+
+double peak_rss_mb(){
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0;  // ru_maxrss is in kB on Linux
+}
+
+int count_tokens(ConllTreebank &tbk, int n){
+    int tokens = 0;
+    for (int i = 0; i < n && i < tbk.size(); i++){
+        tokens += tbk.sentence_size(i);
+    }
+    return tokens;
+}
+
+void print_help(){
+    cout << endl << "Throughput regression harness." << endl << endl <<
+        "Usage:" << endl <<
+        "      ./perf_harness [options]" << endl << endl <<
+        "Options:" << endl <<
+        "  -h     --help                        displays this message and quits" << endl <<
+        "  -s     --sentences       [INT]       size of the synthetic treebank [default=2000]" << endl <<
+        "  -v     --vocsize         [INT]       number of word types [default=5000]" << endl <<
+        "  -z     --zipf            [FLOAT]     exponent of the Zipf word distribution [default=1.0]" << endl <<
+        "  -L     --max-length      [INT]       maximum sentence length [default=40]" << endl <<
+        "  -n     --train           [INT]       number of training sentences [default=300]" << endl <<
+        "  -t     --test            [INT]       number of tagged sentences [default=1000]" << endl <<
+        "  -p     --hyperparameters [STRING]    hyperparameters of neural net [default=production config]" << endl <<
+        "  -M     --multitask       [STRING]    specify what to predict: xm" << endl <<
+        "  -a     --fast-activations            use fast approximations of exp / sigmoid / tanh" << endl <<
+        "  -q     --quantize                    tag with int8 weights (model quantized after export)" << endl <<
+        "  -w     --window          [INT]       tag sentences longer than INT tokens in windows [default=0: off]" << endl <<
+        "  -c     --window-context  [INT]       tokens of context on each side of a window [default=8]" << endl <<
+        "  -C     --cache-mb        [FLOAT]     cache predictions of duplicate sentences within FLOAT MB [default=0: off]" << endl <<
+        "  -o     --output          [STRING]    write results (json) to this file" << endl <<
+        "  -b     --baseline        [STRING]    baseline (json) to compare against" << endl <<
+        "  -e     --tolerance       [FLOAT]     relative tolerance before failing [default=0.1]" << endl << endl;
+}
+
+int main(int argc, char *argv[]){
+    srand(rd::Random::SEED);
+
+    SyntheticCorpus generator;
+    int n_train = 300;
+    int n_test = 1000;
+    double tolerance = 0.1;
+    string hyper_file;
+    string output_code;
+    string output_file;
+    string baseline_file;
+    bool fast_activations = false;
+    bool quantize = false;
+    int window = 0;
+    int window_context = 8;
+    double cache_mb = 0;
+
+    while (true){
+        static struct option long_options[] ={
+        {"help", no_argument, 0, 'h'},
+        {"sentences", required_argument, 0, 's'},
+        {"vocsize", required_argument, 0, 'v'},
+        {"zipf", required_argument, 0, 'z'},
+        {"max-length", required_argument, 0, 'L'},
+        {"train", required_argument, 0, 'n'},
+        {"test", required_argument, 0, 't'},
+        {"hyperparameters", required_argument, 0, 'p'},
+        {"multitask", required_argument, 0, 'M'},
+        {"fast-activations", no_argument, 0, 'a'},
+        {"quantize", no_argument, 0, 'q'},
+        {"window", required_argument, 0, 'w'},
+        {"window-context", required_argument, 0, 'c'},
+        {"cache-mb", required_argument, 0, 'C'},
+        {"output", required_argument, 0, 'o'},
+        {"baseline", required_argument, 0, 'b'},
+        {"tolerance", required_argument, 0, 'e'},
+        {0, 0, 0, 0}};
+
+        int option_index = 0;
+        char c = getopt_long(argc, argv, "hs:v:z:L:n:t:p:M:aqw:c:C:o:b:e:", long_options, &option_index);
+        if (c == -1){
+            break;
+        }
+        switch(c){
+        case 'h': print_help(); exit(0);
+        case 's': generator.n_sentences = atoi(optarg);   break;
+        case 'v': generator.vocsize = atoi(optarg);       break;
+        case 'z': generator.zipf_exponent = atof(optarg); break;
+        case 'L': generator.max_length = atoi(optarg);    break;
+        case 'n': n_train = atoi(optarg);                 break;
+        case 't': n_test = atoi(optarg);                  break;
+        case 'p': hyper_file = optarg;                    break;
+        case 'M': output_code = optarg;                   break;
+        case 'a': fast_activations = true;                break;
+        case 'q': quantize = true;                        break;
+        case 'w': window = atoi(optarg);                  break;
+        case 'c': window_context = atoi(optarg);          break;
+        case 'C': cache_mb = atof(optarg);                break;
+        case 'o': output_file = optarg;                   break;
+        case 'b': baseline_file = optarg;                 break;
+        case 'e': tolerance = atof(optarg);               break;
+        default:
+            print_help();
+            exit(1);
+        }
+    }
+
+    char tmp[] = "/tmp/tagger_perf_XXXXXX";
+    if (mkdtemp(tmp) == nullptr){
+        cerr << "Could not create working directory" << endl;
+        exit(1);
+    }
+    string workdir(tmp);
+    string train_file = workdir + "/train.conllu";
+    string test_file = workdir + "/test.conllu";
+    string model_dir = workdir + "/model";
+    mkdir(model_dir.c_str(), S_IRUSR | S_IWUSR | S_IXUSR);
+
+    generator.write(train_file);
+    generator.sample += 1;
+    generator.write(test_file);
+
+    Metrics metrics;
+    Logger timer;
+
+    ////////////// Reading
+    ConllTreebank train;
+    ConllTreebank test;
+    timer.start();
+    read_conll_corpus(train_file, train, true);
+    timer.stop();
+    read_conll_corpus(test_file, test, false);
+    metrics["read_tokens_per_sec"] = count_tokens(train, train.size()) / timer.get_total_time();
+
+    NeuralNetParameters params;
+    production_hyperparameters(params);
+    if (! hyper_file.empty()){
+        NeuralNetParameters::read_option_file(hyper_file, params);
+    }
+    if (fast_activations){
+        params.fast_activations = true;
+    }
+
+    Output output(output_code);
+    output.update_bigrams(train);
+    train.update_vocsize_and_frequencies();
+    enc::hodor.update_wordform_frequencies(train.get_frequencies_dict());
+    output.max_chars = enc::hodor.longest_size(enc::TOK) + 1;
+    output.get_output_sizes();
+
+    ////////////// Training
+    {
+        BiLstmTagger tagger(enc::hodor.size(enc::TOK), output.n_labels, params);
+        vector<STRCODE> X;
+        LabelView Y;
+        Logger train_timer;
+        train_timer.start();
+        for (int i = 0; i < n_train && i < train.size(); i++){
+            train.to_training_example(i, X, Y, output);
+            tagger.train_one(X, Y);
+        }
+        train_timer.stop();
+        metrics["train_tokens_per_sec"] = count_tokens(train, n_train) / train_timer.get_total_time();
+
+        if (quantize){
+            tagger.quantize();
+        }
+        output.export_model(model_dir);
+        tagger.export_model(model_dir);
+    }
+
+    ////////////// Loading (as in test mode)
+    Logger load_timer;
+    load_timer.start();
+    enc::import_encoders(model_dir);
+    Output test_output("");
+    test_output.import_model(model_dir);
+    NeuralNetParameters test_params;
+    NeuralNetParameters::read_option_file(model_dir + "/hyperparameters", test_params);
+    test_output.get_output_sizes();
+    RunMode::inference_only = true;
+    BiLstmTagger tagger(enc::hodor.size(enc::TOK), test_output.n_labels, test_params);
+    tagger.import_model(model_dir);
+    tagger.set_window(window, window_context, 0);
+    shared_ptr<PredictionCache> cache;
+    if (cache_mb > 0){
+        cache = shared_ptr<PredictionCache>(new PredictionCache(cache_mb * 1024 * 1024));
+        tagger.set_prediction_cache(cache);
+    }
+    load_timer.stop();
+    metrics["model_load_sec"] = load_timer.get_total_time();  // includes char-lstm precomputation
+
+    Logger precompute_timer;
+    precompute_timer.start();
+    tagger.precompute_char_lstm();
+    precompute_timer.stop();
+    metrics["char_precompute_sec"] = precompute_timer.get_total_time();
+
+    ////////////// Tagging
+    NeuralNode::reset_peak_bytes();
+    vector<STRCODE> X;
+    LabelView gold;
+    vector<vector<int>> pred;
+    int correct = 0;
+    Logger tag_timer;
+    tag_timer.start();
+    for (int i = 0; i < n_test && i < test.size(); i++){
+        test.to_training_example(i, X, gold, test_output);
+        tagger.predict_one(X, pred);
+        for (int j = 0; j < pred.size(); j++){
+            correct += pred[j][0] == gold[j][0];
+        }
+    }
+    tag_timer.stop();
+    metrics["tag_tokens_per_sec"] = count_tokens(test, n_test) / tag_timer.get_total_time();
+    metrics["tag_accuracy"] = 100.0 * correct / count_tokens(test, n_test);  // first task (upos)
+    if (cache != nullptr){
+        metrics["cache_hit_rate"] = double(cache->hits) / std::max<size_t>(1, cache->hits + cache->misses);
+    }
+
+    metrics["peak_rss_mb"] = peak_rss_mb();
+
+    MemoryReport report;
+    tagger.memory_usage(report);
+    metrics["model_mb"] = (report.total() - report.bytes[MemoryReport::GRAPH]) / (1024.0 * 1024.0);
+    metrics["graph_workspace_peak_mb"] = report.bytes[MemoryReport::GRAPH] / (1024.0 * 1024.0);
+
+    nftw(workdir.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+    write_json(cout, metrics);
+    if (! output_file.empty()){
+        ofstream os(output_file);
+        write_json(os, metrics);
+        os.close();
+    }
+
+    if (! baseline_file.empty()){
+        Metrics baseline;
+        if (! read_json(baseline_file, baseline)){
+            cerr << "Could not read baseline " << baseline_file << endl;
+            exit(1);
+        }
+        if (! compare_to_baseline(metrics, baseline, tolerance)){
+            cerr << "Performance regression (tolerance " << tolerance << ")" << endl;
+            exit(1);
+        }
+    }
+}
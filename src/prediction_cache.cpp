@@ -0,0 +1,104 @@
+#include "prediction_cache.h"
+
+
+PredictionCache::PredictionCache(size_t max_bytes)
+    : hits(0), misses(0), evictions(0), max_bytes(max_bytes), used_bytes(0){}
+
+size_t PredictionCache::hash(uint64_t model, const vector<STRCODE> &X){
+    // 64 bit FNV-1a over the model id and the token codes
+    uint64_t h = 14695981039346656037ULL;
+    h = (h ^ model) * 1099511628211ULL;
+    for (STRCODE x : X){
+        h = (h ^ x) * 1099511628211ULL;
+    }
+    return h;
+}
+
+PredictionCache::EntryRef PredictionCache::find(size_t h, uint64_t model, const vector<STRCODE> &X){
+    auto range = index.equal_range(h);
+    for (auto it = range.first; it != range.second; ++it){
+        if (it->second->model == model && it->second->X == X){
+            return it->second;
+        }
+    }
+    return entries.end();
+}
+
+bool PredictionCache::get(uint64_t model, const vector<STRCODE> &X, vector<vector<int>> &Y){
+    size_t h = hash(model, X);
+    std::lock_guard<std::mutex> lock(mutex);
+    EntryRef e = find(h, model, X);
+    if (e == entries.end()){
+        misses++;
+        return false;
+    }
+    hits++;
+    entries.splice(entries.begin(), entries, e);
+    Y.resize(e->X.size());
+    for (int i = 0; i < Y.size(); i++){
+        Y[i].assign(e->Y.begin() + i * e->n_tasks, e->Y.begin() + (i + 1) * e->n_tasks);
+    }
+    return true;
+}
+
+void PredictionCache::put(uint64_t model, const vector<STRCODE> &X, const vector<vector<int>> &Y){
+    assert(X.size() == Y.size());
+    int n_tasks = Y.empty() ? 0 : Y[0].size();
+    // list and hash table nodes counted as 8 pointers
+    size_t b = sizeof(Entry) + 8 * sizeof(void*) + X.size() * (sizeof(STRCODE) + n_tasks * sizeof(int));
+    if (b > max_bytes){
+        return;
+    }
+    size_t h = hash(model, X);
+    std::lock_guard<std::mutex> lock(mutex);
+    if (find(h, model, X) != entries.end()){
+        return;
+    }
+    entries.push_front(Entry());
+    Entry &e = entries.front();
+    e.model = model;
+    e.hash = h;
+    e.X = X;
+    e.n_tasks = n_tasks;
+    e.Y.reserve(X.size() * n_tasks);
+    for (const vector<int> &y : Y){
+        e.Y.insert(e.Y.end(), y.begin(), y.end());
+    }
+    e.bytes = b;
+    index.insert(std::make_pair(h, entries.begin()));
+    used_bytes += b;
+    evict();
+}
+
+void PredictionCache::evict(){
+    while (used_bytes > max_bytes){
+        Entry &e = entries.back();
+        auto range = index.equal_range(e.hash);
+        for (auto it = range.first; it != range.second; ++it){
+            if (&*it->second == &e){
+                index.erase(it);
+                break;
+            }
+        }
+        used_bytes -= e.bytes;
+        entries.pop_back();
+        evictions++;
+    }
+}
+
+void PredictionCache::clear(){
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+    index.clear();
+    used_bytes = 0;
+}
+
+size_t PredictionCache::size(){
+    std::lock_guard<std::mutex> lock(mutex);
+    return entries.size();
+}
+
+size_t PredictionCache::bytes(){
+    std::lock_guard<std::mutex> lock(mutex);
+    return used_bytes;
+}
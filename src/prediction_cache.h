@@ -0,0 +1,61 @@
+#ifndef PREDICTION_CACHE_H
+#define PREDICTION_CACHE_H
+
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+
+#include "utils.h"
+
+/**
+ * @brief The PredictionCache struct stores the predictions of whole
+ * sentences (BiLstmTagger::predict_one), keyed on the encoded sentence
+ * and the id of the model that tagged it, so that duplicate sentences
+ * are not tagged again.
+ * Entries are evicted in least recently used order once they take more
+ * than max_bytes. Can be shared by several taggers (thread safe).
+ */
+struct PredictionCache{
+    PredictionCache(size_t max_bytes);
+
+    // true (and Y set) if X was tagged by model
+    bool get(uint64_t model, const vector<STRCODE> &X, vector<vector<int>> &Y);
+    void put(uint64_t model, const vector<STRCODE> &X, const vector<vector<int>> &Y);
+    void clear();
+
+    size_t size();          // number of entries
+    size_t bytes();         // approximate memory used by the entries
+
+    std::atomic<size_t> hits;
+    std::atomic<size_t> misses;
+    std::atomic<size_t> evictions;
+
+    PredictionCache(const PredictionCache&) = delete;
+    PredictionCache& operator=(const PredictionCache&) = delete;
+
+private:
+    struct Entry{
+        uint64_t model;
+        size_t hash;
+        vector<STRCODE> X;
+        vector<int> Y;      // X.size() x n_tasks, row major
+        int n_tasks;
+        size_t bytes;
+    };
+    typedef std::list<Entry>::iterator EntryRef;
+
+    size_t max_bytes;
+    size_t used_bytes;
+    std::list<Entry> entries;                           // most recently used first
+    std::unordered_multimap<size_t, EntryRef> index;    // hash -> entries
+    std::mutex mutex;
+
+    static size_t hash(uint64_t model, const vector<STRCODE> &X);
+    EntryRef find(size_t h, uint64_t model, const vector<STRCODE> &X);
+    void evict();
+};
+
+#endif // PREDICTION_CACHE_H
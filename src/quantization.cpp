@@ -0,0 +1,248 @@
+#include "quantization.h"
+
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define Q8_X86
+#endif
+
+namespace q8{
+
+namespace {
+
+const int ALIGN = 32;   // row stride granularity (bytes)
+
+int32_t dot_scalar(const int8_t *x, const int8_t *w, int n){
+    int32_t s = 0;
+    for (int j = 0; j < n; j++){
+        s += int32_t(x[j]) * int32_t(w[j]);
+    }
+    return s;
+}
+
+#ifdef Q8_X86
+
+__attribute__((target("avx2")))
+inline int32_t hsum_avx2(__m256i v){
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(s);
+}
+
+// vpmaddubsw multiplies unsigned by signed bytes: |x| * (w * sign(x)).
+// Since q and xq are in [-127, 127], pair sums fit in int16 (no saturation).
+__attribute__((target("avx2")))
+int32_t dot_avx2(const int8_t *x, const int8_t *w, int n){
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i acc = _mm256_setzero_si256();
+    for (int j = 0; j < n; j += 32){
+        __m256i vx = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x + j));
+        __m256i vw = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(w + j));
+        __m256i p = _mm256_maddubs_epi16(_mm256_abs_epi8(vx), _mm256_sign_epi8(vw, vx));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(p, ones));
+    }
+    return hsum_avx2(acc);
+}
+
+// gcc 12 warns about the _mm512_undefined_* placeholders used in avx512fintrin.h
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+// vpdpbusd: unsigned x (xq + 128) times signed w, 4 products summed in int32.
+// Returns sum_j (xq[j] + 128) * w[j]; the caller subtracts 128 * row_sum.
+__attribute__((target("avx2,avx512f,avx512bw,avx512vl,avx512vnni")))
+int32_t dot_vnni(const uint8_t *x, const int8_t *w, int n){
+    int j = 0;
+    int32_t s = 0;
+    if (n >= 64){
+        __m512i acc = _mm512_setzero_si512();
+        for (; j + 64 <= n; j += 64){
+            acc = _mm512_dpbusd_epi32(acc, _mm512_loadu_si512(x + j), _mm512_loadu_si512(w + j));
+        }
+        s = _mm512_reduce_add_epi32(acc);
+    }
+    if (j < n){     // n is a multiple of 32
+        __m256i acc = _mm256_dpbusd_epi32(_mm256_setzero_si256(),
+                                          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x + j)),
+                                          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(w + j)));
+        s += hsum_avx2(acc);
+    }
+    return s;
+}
+
+#pragma GCC diagnostic pop
+
+#endif
+}
+
+int detect_isa(){
+#ifdef Q8_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512bw")
+            && __builtin_cpu_supports("avx512vl")){
+        return AVX512_VNNI;
+    }
+    if (__builtin_cpu_supports("avx2")){
+        return AVX2;
+    }
+#endif
+    return SCALAR;
+}
+
+const char* isa_name(int isa){
+    switch (isa){
+    case AVX512_VNNI: return "avx512_vnni";
+    case AVX2: return "avx2";
+    default: return "scalar";
+    }
+}
+
+int isa = detect_isa();
+
+}
+
+
+const char QMat::MAGIC[8] = {'Q', '8', 'M', 'A', 'T', '0', '0', '1'};
+
+QMat::QMat():rows(0), cols(0), stride(0){}
+
+bool QMat::empty() const{
+    return rows == 0;
+}
+
+void QMat::quantize(const Eigen::MatrixXd &w){
+    rows = w.rows();
+    cols = w.cols();
+    stride = (cols + q8::ALIGN - 1) / q8::ALIGN * q8::ALIGN;
+    q.assign(size_t(rows) * stride, 0);
+    scales.resize(rows);
+    row_sums.resize(rows);
+    for (int i = 0; i < rows; i++){
+        double m = w.row(i).cwiseAbs().maxCoeff();
+        scales[i] = m / 127.0;
+        double inv = m > 0 ? 127.0 / m : 0.0;
+        int32_t sum = 0;
+        for (int j = 0; j < cols; j++){
+            int v = std::lround(w(i, j) * inv);
+            v = std::min(127, std::max(-127, v));
+            q[size_t(i) * stride + j] = v;
+            sum += v;
+        }
+        row_sums[i] = sum;
+    }
+}
+
+void QMat::dequantize(Eigen::MatrixXd &w) const{
+    w.resize(rows, cols);
+    for (int i = 0; i < rows; i++){
+        for (int j = 0; j < cols; j++){
+            w(i, j) = scales[i] * q[size_t(i) * stride + j];
+        }
+    }
+}
+
+void QMat::gemv(const double *x, double *y, bool accumulate) const{
+    static thread_local std::vector<int8_t> xq;
+    static thread_local std::vector<uint8_t> xu;
+
+    double m = 0.0;
+    for (int j = 0; j < cols; j++){
+        m = std::max(m, std::abs(x[j]));
+    }
+    if (m == 0.0){
+        if (! accumulate){
+            std::fill(y, y + rows, 0.0);
+        }
+        return;
+    }
+    double sx = m / 127.0;
+    double inv = 127.0 / m;
+    if (! accumulate){
+        std::fill(y, y + rows, 0.0);
+    }
+
+    const int8_t *w = q.data();
+    switch (q8::isa){
+#ifdef Q8_X86
+    case q8::AVX512_VNNI:
+        xu.resize(stride);
+        for (int j = 0; j < cols; j++){
+            xu[j] = uint8_t(int(x[j] * inv + 128.5));     // round(x * inv) + 128, in [1, 255]
+        }
+        std::fill(xu.begin() + cols, xu.end(), 128);
+        for (int i = 0; i < rows; i++, w += stride){
+            int32_t s = q8::dot_vnni(xu.data(), w, stride) - 128 * row_sums[i];
+            y[i] += s * (scales[i] * sx);
+        }
+        return;
+#endif
+    default:
+        break;
+    }
+
+    xq.resize(stride);
+    for (int j = 0; j < cols; j++){
+        xq[j] = int8_t(int(x[j] * inv + 128.5) - 128);
+    }
+    std::fill(xq.begin() + cols, xq.end(), 0);
+    w = q.data();
+#ifdef Q8_X86
+    if (q8::isa == q8::AVX2){
+        for (int i = 0; i < rows; i++, w += stride){
+            y[i] += q8::dot_avx2(xq.data(), w, stride) * (scales[i] * sx);
+        }
+        return;
+    }
+#endif
+    for (int i = 0; i < rows; i++, w += stride){
+        y[i] += q8::dot_scalar(xq.data(), w, cols) * (scales[i] * sx);
+    }
+}
+
+void QMat::write_binary(std::ostream &os) const{
+    os.write(MAGIC, sizeof(MAGIC));
+    ::write_binary<int32_t>(os, rows);
+    ::write_binary<int32_t>(os, cols);
+    ::write_binary(os, scales.data(), rows);
+    for (int i = 0; i < rows; i++){
+        ::write_binary(os, q.data() + size_t(i) * stride, cols);
+    }
+    size_t padding = (4 - (size_t(rows) * cols) % 4) % 4;
+    const char zeros[4] = {0, 0, 0, 0};
+    os.write(zeros, padding);
+}
+
+void QMat::read_binary(BinaryReader &in){
+    const char *magic = in.read_array<char>(sizeof(MAGIC));
+    if (magic == nullptr || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0){
+        in.fail = true;
+        return;
+    }
+    rows = in.read<int32_t>();
+    cols = in.read<int32_t>();
+    const float *s = in.read_array<float>(rows);
+    const int8_t *data = in.read_array<int8_t>(size_t(rows) * cols);
+    in.read_array<char>((4 - (size_t(rows) * cols) % 4) % 4);
+    if (in.fail){
+        rows = cols = stride = 0;
+        return;
+    }
+    stride = (cols + q8::ALIGN - 1) / q8::ALIGN * q8::ALIGN;
+    scales.assign(s, s + rows);
+    q.assign(size_t(rows) * stride, 0);
+    row_sums.assign(rows, 0);
+    for (int i = 0; i < rows; i++){
+        for (int j = 0; j < cols; j++){
+            q[size_t(i) * stride + j] = data[size_t(i) * cols + j];
+            row_sums[i] += data[size_t(i) * cols + j];
+        }
+    }
+}
+
+size_t QMat::memory_usage() const{
+    return sizeof(QMat) + q.capacity() + scales.capacity() * sizeof(float) + row_sums.capacity() * sizeof(int32_t);
+}
@@ -0,0 +1,59 @@
+#ifndef QUANTIZATION_H
+#define QUANTIZATION_H
+
+#include <Eigen/Dense>
+#include <vector>
+#include <cstdint>
+#include <iostream>
+
+#include "utils.h"
+
+// Post-training int8 quantization of weight matrices (inference only).
+//
+// Weights: symmetric, one scale per row, w(i,j) ~ scales[i] * q(i,j),
+// q in [-127, 127]. Input vectors are quantized on the fly with a single
+// scale (max |x| / 127), so that y = W x is computed with int32
+// dot products: y[i] = scales[i] * sx * sum_j q(i,j) xq[j].
+//
+// Integer dot products use AVX-512 VNNI (vpdpbusd), AVX2 (vpmaddubsw),
+// or scalar code; the instruction set is selected at runtime.
+namespace q8{
+
+enum {SCALAR, AVX2, AVX512_VNNI};
+
+int detect_isa();                   // best instruction set supported by the cpu
+const char* isa_name(int isa);
+
+// Instruction set used by QMat::gemv (detect_isa() by default).
+// Can be lowered (e.g. to compare implementations), not raised above detect_isa().
+extern int isa;
+
+}
+
+struct QMat{
+    int rows;
+    int cols;
+    int stride;                     // cols rounded up to a multiple of 32 (zero padding)
+    std::vector<int8_t> q;          // rows x stride, row major
+    std::vector<float> scales;      // per row
+    std::vector<int32_t> row_sums;  // sum_j q(i,j), compensates the unsigned input offset of vpdpbusd
+
+    QMat();
+    bool empty() const;
+
+    void quantize(const Eigen::MatrixXd &w);
+    void dequantize(Eigen::MatrixXd &w) const;
+
+    // y = W x, or y += W x if accumulate (x: cols values, y: rows values)
+    void gemv(const double *x, double *y, bool accumulate=false) const;
+
+    // Fields (rows, cols, scales, q unpadded), see write_binary in utils.h
+    void write_binary(std::ostream &os) const;
+    void read_binary(BinaryReader &in);
+
+    size_t memory_usage() const;
+
+    static const char MAGIC[8];     // first bytes of a quantized matrix file
+};
+
+#endif // QUANTIZATION_H
@@ -1,6 +1,10 @@
 
 #include "random_utils.h"
 
+#include <atomic>
+#include <algorithm>
+#include <Eigen/Dense>
+
 namespace rd{
 
 const int Random::SEED{1};
@@ -14,5 +18,75 @@ double random(){
 }
 
 
+namespace {
+uint64_t splitmix64(uint64_t &x){
+    uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+inline uint64_t rotl(uint64_t x, int k){
+    return (x << k) | (x >> (64 - k));
+}
+
+std::atomic<uint64_t> n_thread_generators(0);
+}
+
+Xoshiro256::Xoshiro256(uint64_t seed){
+    for (int i = 0; i < 4; i++){
+        s[i] = splitmix64(seed);
+    }
+}
+
+uint64_t Xoshiro256::next(){
+    uint64_t result = s[0] + s[3];
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+double Xoshiro256::uniform(){
+    // 53 high bits, shifted to (0, 1] so that log() is finite
+    return ((next() >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+void Xoshiro256::normal(double *out, int n, double sigma){
+    // Box-Muller on blocks of uniforms. The transcendental functions
+    // are evaluated in single precision on Eigen arrays (vectorized),
+    // which is plenty for gradient noise.
+    const int PAIRS = 128;
+    float u1[PAIRS], u2[PAIRS], r[PAIRS], theta[PAIRS];
+    for (int start = 0; start < n; start += 2 * PAIRS){
+        int m = std::min(2 * PAIRS, n - start);
+        int pairs = (m + 1) / 2;
+        for (int i = 0; i < pairs; i++){
+            uint64_t x = next();    // two 24-bit uniforms in (0, 1] from one draw
+            u1[i] = ((x >> 40) + 1) * (1.0f / 16777216.0f);
+            u2[i] = (((x >> 16) & 0xffffff) + 1) * (1.0f / 16777216.0f);
+        }
+        Eigen::Map<Eigen::ArrayXf> a1(u1, pairs), a2(u2, pairs), ar(r, pairs), at(theta, pairs);
+        ar = float(sigma) * (-2.0f * a1.log()).sqrt();
+        at = float(2.0 * M_PI) * a2;
+        a1 = ar * at.cos();
+        a2 = ar * at.sin();
+        for (int i = 0; i < pairs; i++){
+            out[start + i] = u1[i];
+        }
+        for (int i = 0; i < m - pairs; i++){
+            out[start + pairs + i] = u2[i];
+        }
+    }
+}
+
+Xoshiro256& thread_generator(){
+    thread_local Xoshiro256 generator(Random::SEED + n_thread_generators++ * 0x632be59bd9b4e019ULL);
+    return generator;
 }
 
+}
@@ -2,6 +2,7 @@
 #define RANDOM_UTILS_H
 
 #include <random>
+#include <cstdint>
 
 
 namespace rd{
@@ -18,6 +19,28 @@ struct Random{
 };
 
 double random();
+
+/**
+ * @brief The Xoshiro256 struct is a small and fast generator
+ * (xoshiro256+, Blackman & Vigna) with a blocked
+ * Box-Muller sampler for gaussian noise.
+ */
+struct Xoshiro256{
+    uint64_t s[4];
+
+    explicit Xoshiro256(uint64_t seed);
+
+    uint64_t next();
+    double uniform();   // in (0, 1]
+
+    // Fills out[0..n-1] with samples from N(0, sigma^2)
+    void normal(double *out, int n, double sigma);
+};
+
+// Generator of the calling thread. Generators are seeded from SEED
+// and the order in which threads first use them: runs with
+// a single thread are reproducible.
+Xoshiro256& thread_generator();
 }
 
 #endif // RANDOM_UTILS_H
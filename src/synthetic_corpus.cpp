@@ -0,0 +1,135 @@
+#include "synthetic_corpus.h"
+
+#include <fstream>
+#include <cmath>
+#include <algorithm>
+
+namespace {
+const char* UPOS_TAGS[] = {"ADJ", "ADP", "ADV", "AUX", "CCONJ", "DET", "INTJ", "NOUN", "NUM",
+                           "PART", "PRON", "PROPN", "PUNCT", "SCONJ", "SYM", "VERB", "X"};
+const int N_UPOS_TAGS = 17;
+
+const char* LETTERS[] = {"a", "b", "c", "d", "e", "f", "g", "h", "i", "j", "k", "l", "m",
+                         "n", "o", "p", "q", "r", "s", "t", "u", "v", "w", "x", "y", "z",
+                         "\xc3\xa9", "\xc3\xb6", "\xc3\x9f"};   // é ö ß: exercise utf8 decoding
+const int N_LETTERS = 29;
+
+const char* NUMBER[] = {"Sing", "Plur"};
+const char* CASE[] = {"Nom", "Acc", "Gen", "Dat"};
+const char* TENSE[] = {"Past", "Pres", "Fut"};
+}
+
+SyntheticCorpus::SyntheticCorpus():
+    n_sentences(1000),
+    vocsize(5000),
+    zipf_exponent(1.0),
+    min_length(5),
+    max_length(40),
+    n_upos(N_UPOS_TAGS),
+    n_xpos(40),
+    seed(1),
+    sample(0){}
+
+void SyntheticCorpus::init(std::mt19937 &gen){
+    words.clear();
+    cumulative.clear();
+    std::uniform_int_distribution<int> length(1, 12);
+    std::uniform_int_distribution<int> letter(0, N_LETTERS - 1);
+    for (int w = 0; w < vocsize; w++){
+        string s;
+        int l = length(gen);
+        for (int c = 0; c < l; c++){
+            s += LETTERS[letter(gen)];
+        }
+        s += std::to_string(w); // makes all word types distinct
+        words.push_back(s);
+    }
+    double total = 0.0;
+    for (int w = 0; w < vocsize; w++){
+        total += 1.0 / pow(w + 1.0, zipf_exponent);
+        cumulative.push_back(total);
+    }
+    for (double &c : cumulative){
+        c /= total;
+    }
+}
+
+int SyntheticCorpus::sample_word(std::mt19937 &gen){
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    double u = uniform(gen);
+    auto it = std::lower_bound(cumulative.begin(), cumulative.end(), u);
+    if (it == cumulative.end()){
+        return vocsize - 1;
+    }
+    return it - cumulative.begin();
+}
+
+void SyntheticCorpus::write_token(ostream &os, int i, int word, std::mt19937 &gen){
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    int upos = word % n_upos;
+    if (uniform(gen) < 0.1){    // ambiguous words
+        upos = (upos + 1) % n_upos;
+    }
+    int xpos = (word * 7 + upos) % n_xpos;
+
+    string feats;
+    switch (word % 4){
+    case 0: feats = string("Case=") + CASE[word / 4 % 4] + "|Number=" + NUMBER[word % 2]; break;
+    case 1: feats = string("Number=") + NUMBER[(word / 4) % 2]; break;
+    case 2: feats = string("Tense=") + TENSE[word / 4 % 3]; break;
+    default: feats = "_";
+    }
+
+    os << i << "\t"
+       << words[word] << "\t"
+       << "_" << "\t"
+       << UPOS_TAGS[upos % N_UPOS_TAGS] << "\t"
+       << "X" << xpos << "\t"
+       << feats << "\t"
+       << "_\t_\t_\t_" << endl;
+}
+
+void SyntheticCorpus::write(ostream &os){
+    std::mt19937 vocab_gen(seed);
+    init(vocab_gen);
+    std::mt19937 gen(seed * 7919 + sample);
+    std::uniform_int_distribution<int> length(min_length, max_length);
+    for (int s = 0; s < n_sentences; s++){
+        os << "# sent_id = " << s << endl;
+        int n = length(gen);
+        for (int i = 1; i <= n; i++){
+            write_token(os, i, sample_word(gen), gen);
+        }
+        os << endl;
+    }
+}
+
+void SyntheticCorpus::write(const string &filename){
+    ofstream os(filename);
+    write(os);
+    os.close();
+}
+
+void SyntheticCorpus::random_sentence(int length, vector<STRCODE> &X, std::mt19937 &gen){
+    int vocsize = enc::hodor.size(enc::TOK);
+    assert(vocsize > 2);
+    std::uniform_int_distribution<int> word(2, vocsize - 1);  // skip UNKNOWN / UNDEF
+    X.clear();
+    for (int i = 0; i < length; i++){
+        X.push_back(word(gen));
+    }
+}
+
+void production_hyperparameters(NeuralNetParameters &params){
+    params.learning_rate = 0.02;
+    params.gaussian_noise_eta = 0.01;
+    params.topology.n_hidden_layers = 0;
+    params.topology.embedding_size_type = {20, 16, 16};
+    params.rnn.cell_type = RecurrentLayerWrapper::LN_LSTM;
+    params.rnn.depth = 2;
+    params.rnn.hidden_size = 32;
+    params.rnn.features = 1;
+    params.rnn.crnn.crnn = 1;
+    params.rnn.crnn.dim_char = 32;
+    params.rnn.crnn.dim_char_based_embeddings = 32;
+}
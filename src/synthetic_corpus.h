@@ -0,0 +1,54 @@
+#ifndef SYNTHETIC_CORPUS_H
+#define SYNTHETIC_CORPUS_H
+
+#include <string>
+#include <vector>
+#include <random>
+
+#include "utils.h"
+#include "neural_net_hyperparameters.h"
+
+using std::string;
+using std::vector;
+
+/**
+ * @brief The SyntheticCorpus struct generates a random
+ * CoNLL-U treebank (forms, UPOS, XPOS, FEATS) so that
+ * benchmarks can run offline. Word frequencies follow
+ * a Zipf law, tags and features are a (noisy)
+ * function of the word type so that the task is learnable.
+ */
+struct SyntheticCorpus{
+    int n_sentences;
+    int vocsize;
+    double zipf_exponent;
+    int min_length;
+    int max_length;
+    int n_upos;
+    int n_xpos;
+    int seed;       // vocabulary and tag assignments
+    int sample;     // different samples share the same vocabulary
+
+    SyntheticCorpus();
+
+    void write(const string &filename);
+    void write(ostream &os);
+
+    // Random sentence of exactly 'length' token codes
+    // taken from the already populated enc::hodor vocabulary
+    static void random_sentence(int length, vector<STRCODE> &X, std::mt19937 &gen);
+
+private:
+    vector<string> words;
+    vector<double> cumulative;
+
+    void init(std::mt19937 &gen);
+    int sample_word(std::mt19937 &gen);
+    void write_token(ostream &os, int i, int word, std::mt19937 &gen);
+};
+
+// Hyperparameters of the production configuration (bin/hyperparameters),
+// shared by the benchmarks and the throughput harness
+void production_hyperparameters(NeuralNetParameters &params);
+
+#endif // SYNTHETIC_CORPUS_H
@@ -1,6 +1,127 @@
 
 #include "utils.h"
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+size_t string_memory_usage(const String &s){
+    size_t bytes = sizeof(String);
+    if (s.capacity() * sizeof(Char) >= sizeof(String)){ // not stored in place (short string optimization)
+        bytes += (s.capacity() + 1) * sizeof(Char);
+    }
+    return bytes;
+}
+
+
+MappedFile::MappedFile(const string &filename) : data(nullptr), size(0){
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1){
+        return;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) == 0 && sb.st_size > 0){
+        void *p = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED){
+            data = static_cast<const char*>(p);
+            size = sb.st_size;
+        }
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile(){
+    if (data != nullptr){
+        munmap(const_cast<char*>(data), size);
+    }
+}
+
+bool MappedFile::is_open(){
+    return data != nullptr;
+}
+
+void write_binary_string(ostream &os, const string &s){
+    write_binary(os, int32_t(s.size()));
+    os.write(s.data(), s.size());
+    const char padding[4] = {0, 0, 0, 0};
+    os.write(padding, (4 - s.size() % 4) % 4);
+}
+
+BinaryReader::BinaryReader(const char *data, size_t size) : data(data), end(data + size), fail(data == nullptr){}
+
+string BinaryReader::read_string(){
+    int32_t size = read<int32_t>();
+    const char *s = read_array<char>(size + (4 - size % 4) % 4);
+    if (s == nullptr || size < 0){
+        fail = true;
+        return string();
+    }
+    return string(s, size);
+}
+
+ThreadPool::ThreadPool(int n_threads) : tasks(nullptr), next(0), pending(0), stop(false){
+    for (int i = 1; i < n_threads; i++){
+        workers.push_back(std::thread(&ThreadPool::worker, this));
+    }
+}
+
+ThreadPool::~ThreadPool(){
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    work.notify_all();
+    for (std::thread &t : workers){
+        t.join();
+    }
+}
+
+int ThreadPool::size() const{
+    return workers.size() + 1;
+}
+
+void ThreadPool::run(const vector<std::function<void()>> &group){
+    if (workers.empty() || group.size() < 2){
+        for (const std::function<void()> &f : group){
+            f();
+        }
+        return;
+    }
+    std::lock_guard<std::mutex> serial(run_mutex);
+    std::unique_lock<std::mutex> lock(mutex);
+    tasks = &group;
+    next = 0;
+    pending = group.size();
+    work.notify_all();
+    while (next < group.size()){
+        size_t i = next++;
+        lock.unlock();
+        group[i]();
+        lock.lock();
+        pending--;
+    }
+    done.wait(lock, [this]{ return pending == 0; });
+    tasks = nullptr;
+}
+
+void ThreadPool::worker(){
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true){
+        work.wait(lock, [this]{ return stop || (tasks != nullptr && next < tasks->size()); });
+        if (stop){
+            return;
+        }
+        const std::function<void()> &f = (*tasks)[next++];
+        lock.unlock();
+        f();
+        lock.lock();
+        if (--pending == 0){
+            done.notify_all();
+        }
+    }
+}
+
 
 namespace enc{
 
@@ -63,6 +184,52 @@ int StrDict::longest_size(){
     return max;
 }
 
+size_t StrDict::memory_usage(){
+    // hash table: buckets + one node (next pointer, key, value, cached hash) per entry
+    size_t bytes = encoder.bucket_count() * sizeof(void*);
+    for (auto &it : encoder){
+        bytes += sizeof(void*) + sizeof(size_t) + sizeof(int) + string_memory_usage(it.first);
+    }
+    bytes += (decoder.capacity() - decoder.size()) * sizeof(String);
+    for (String &s : decoder){
+        bytes += string_memory_usage(s);
+    }
+    return bytes;
+}
+
+void StrDict::write_binary(ostream &os){
+    static_assert(sizeof(Char) == 4, "binary dictionaries assume 32-bit wchar_t");
+    ::write_binary(os, int32_t(decoder.size()));
+    for (String &s : decoder){
+        ::write_binary(os, int32_t(s.size()));
+        ::write_binary(os, s.data(), s.size());
+    }
+}
+
+void StrDict::read_binary(BinaryReader &in){
+    encoder.clear();
+    decoder.clear();
+    int32_t n = in.read<int32_t>();
+    // each string takes at least its size (4 bytes): rejects corrupt counts before reserving
+    if (in.fail || n < 0 || size_t(n) > size_t(in.end - in.data) / sizeof(int32_t)){
+        in.fail = true;
+        size_ = 0;
+        return;
+    }
+    encoder.reserve(n);
+    decoder.reserve(n);
+    for (int i = 0; i < n && ! in.fail; i++){
+        int32_t size = in.read<int32_t>();
+        const Char *s = in.read_array<Char>(size);
+        if (s == nullptr){
+            break;
+        }
+        decoder.push_back(String(s, size));
+        encoder[decoder.back()] = i;
+    }
+    size_ = decoder.size();
+}
+
 ostream & operator<<(ostream &os, StrDict &ts){
     for (int i = 0; i < ts.decoder.size(); i++){
         os << str::encode(ts.decoder[i]) << endl;
@@ -85,6 +252,10 @@ double Frequencies::freq(STRCODE code){
     return counts[code];
 }
 
+size_t Frequencies::memory_usage(){
+    return counts.capacity() * sizeof(float);
+}
+
 
 
 TypedStrEncoder::TypedStrEncoder(){
@@ -111,6 +282,11 @@ string TypedStrEncoder::decode_to_str(STRCODE i, int type){
     return str::encode(decode(i,type));
 }
 
+int TypedStrEncoder::length(STRCODE i, int type){
+    assert(type < encoders.size() && i < encoders[type].decoder.size());
+    return encoders[type].decoder[i].size();
+}
+
 int TypedStrEncoder::size(int type){
     ensure_size(type);
     return encoders[type].size();
@@ -190,6 +366,42 @@ void TypedStrEncoder::import_model(const string &outdir, const string prefix){
     update_header_map();
 }
 
+void TypedStrEncoder::write_binary(ostream &os){
+    ::write_binary(os, int32_t(encoders.size()));
+    for (StrDict &d : encoders){
+        d.write_binary(os);
+    }
+    ::write_binary(os, int32_t(header.size()));
+    for (string &h : header){
+        write_binary_string(os, h);
+    }
+}
+
+void TypedStrEncoder::read_binary(BinaryReader &in){
+    encoders.clear();
+    header.clear();
+    header_map.clear();
+    int32_t n = in.read<int32_t>();
+    // each dictionary and header string takes at least 4 bytes
+    if (in.fail || n < 0 || size_t(n) > size_t(in.end - in.data) / sizeof(int32_t)){
+        in.fail = true;
+        return;
+    }
+    for (int i = 0; i < n && ! in.fail; i++){
+        encoders.push_back(StrDict());
+        encoders.back().read_binary(in);
+    }
+    n = in.read<int32_t>();
+    if (in.fail || n < 0 || size_t(n) > size_t(in.end - in.data) / sizeof(int32_t)){
+        in.fail = true;
+        return;
+    }
+    for (int i = 0; i < n && ! in.fail; i++){
+        header.push_back(in.read_string());
+    }
+    update_header_map();
+}
+
 //void TypedStrEncoder::set_header(vector<string> &header){
 //    this->header = header;
 //    update_header_map();
@@ -255,6 +467,14 @@ void TypedStrEncoder::ensure_size(int type){
         encoders.push_back(StrDict());
     }
 }
+
+size_t TypedStrEncoder::memory_usage(){
+    size_t bytes = freqs.memory_usage();
+    for (StrDict &d : encoders){
+        bytes += d.memory_usage();
+    }
+    return bytes;
+}
 }
 
 
@@ -409,6 +629,14 @@ int SequenceEncoder::char_voc_size(){
     return encoder.size();
 }
 
+size_t SequenceEncoder::memory_usage(){
+    size_t bytes = encoder.memory_usage() + dictionary.capacity() * sizeof(vector<int>);
+    for (vector<int> &v : dictionary){
+        bytes += v.capacity() * sizeof(int);
+    }
+    return bytes;
+}
+
 
 
 
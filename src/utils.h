@@ -7,6 +7,12 @@
 #include <iostream>
 #include <fstream>
 #include <assert.h>
+#include <cstring>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 //#include <memory>
 
 #include "str_utils.h"
@@ -31,6 +37,131 @@ typedef wchar_t Char;
 
 typedef unsigned int STRCODE;
 
+size_t string_memory_usage(const String &s);
+
+// Read-only view of a row-major matrix of integers,
+// e.g. labels of a sentence: Y[i][t] is the label of token i for task t
+struct LabelView{
+    const int *data;
+    int rows;
+    int cols;
+
+    LabelView() : data(nullptr), rows(0), cols(0){}
+    LabelView(const int *data, int rows, int cols) : data(data), rows(rows), cols(cols){}
+
+    const int* operator[](int i) const{
+        assert(i >= 0 && i < rows);
+        return data + i * cols;
+    }
+    int size() const{
+        return rows;
+    }
+};
+
+
+// Predicted class of a task with its probability
+struct LabelProbability{
+    int label;
+    double probability;
+};
+
+// top[i][t]: most probable labels of token i for task t (decreasing probability)
+typedef vector<vector<vector<LabelProbability>>> TopLabels;
+
+
+// Read-only memory mapping of a whole file (unmapped on destruction)
+struct MappedFile{
+    const char *data;
+    size_t size;
+
+    MappedFile(const string &filename);
+    ~MappedFile();
+    bool is_open();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+};
+
+// Binary files are written in native byte order as a sequence of
+// 4-byte aligned fields, so that arrays can be used in place
+// when the file is memory mapped.
+template<typename T>
+void write_binary(ostream &os, const T &v){
+    os.write(reinterpret_cast<const char*>(&v), sizeof(T));
+}
+
+template<typename T>
+void write_binary(ostream &os, const T *v, size_t n){
+    os.write(reinterpret_cast<const char*>(v), n * sizeof(T));
+}
+
+void write_binary_string(ostream &os, const string &s);    // int32 size + bytes + padding
+
+// Sequential reader over a binary buffer (typically a MappedFile).
+// Reading past the end sets fail to true and returns zeros / nullptr.
+struct BinaryReader{
+    const char *data;
+    const char *end;
+    bool fail;
+
+    BinaryReader(const char *data, size_t size);
+
+    template<typename T>
+    T read(){
+        T v = T();
+        if (! fail && data + sizeof(T) <= end){
+            memcpy(&v, data, sizeof(T));
+            data += sizeof(T);
+        }else{
+            fail = true;
+        }
+        return v;
+    }
+
+    // Pointer to n values in place (no copy)
+    template<typename T>
+    const T* read_array(size_t n){
+        if (fail || n > size_t(end - data) / sizeof(T)){
+            fail = true;
+            return nullptr;
+        }
+        const T* v = reinterpret_cast<const T*>(data);
+        data += n * sizeof(T);
+        return v;
+    }
+
+    string read_string();
+};
+
+// Small pool of worker threads for groups of independent tasks.
+// run() returns once every task of the group is done; the calling
+// thread executes tasks too, so a pool of size n has n - 1 workers
+// (none for n <= 1: tasks are run in order by the caller).
+// Concurrent calls to run() are serialized.
+struct ThreadPool{
+    ThreadPool(int n_threads);
+    ~ThreadPool();
+    int size() const;
+
+    void run(const vector<std::function<void()>> &tasks);
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+private:
+    vector<std::thread> workers;
+    std::mutex run_mutex;                       // one group at a time
+    std::mutex mutex;                           // protects the fields below
+    std::condition_variable work;
+    std::condition_variable done;
+    const vector<std::function<void()>> *tasks; // current group (nullptr: idle)
+    size_t next;                                // next task to start
+    size_t pending;                             // tasks started or waiting, not finished
+    bool stop;
+
+    void worker();
+};
+
 // Functions that handle coding typed string on integers
 namespace enc{
     const int MAX_FIELDS = 40;
@@ -57,6 +188,11 @@ namespace enc{
 
         int longest_size();
 
+        size_t memory_usage();   // estimated bytes
+
+        void write_binary(ostream &os);
+        void read_binary(BinaryReader &in);
+
         friend ostream & operator<<(ostream &os, StrDict &ts);
     };
 
@@ -65,6 +201,7 @@ namespace enc{
         double total;
         void update(STRCODE code, double count);
         double freq(STRCODE code);
+        size_t memory_usage();
     };
 
     // String, type (int) -> int dictionary
@@ -79,12 +216,16 @@ namespace enc{
         STRCODE code_unknown(String s, int type);
         String decode(STRCODE i, int type);
         string decode_to_str(STRCODE i, int type);
+        int length(STRCODE i, int type);    // size of decode(i, type), without copy
         int size(int type);
         int longest_size(int type);
         void vocsizes(vector<int> &sizes);
         void reset();
         void export_model(const string &outdir, const string prefix);
         void import_model(const string &outdir, const string prefix);
+        // Dictionaries and header (not frequencies) in binary format
+        void write_binary(ostream &os);
+        void read_binary(BinaryReader &in);
         int find_type_id(string & type, bool add);
         void update_header_map();
         int get_dep_idx();
@@ -94,6 +235,8 @@ namespace enc{
 
         int size();
         void ensure_size(int type);
+
+        size_t memory_usage();
     };
 
     void export_encoders(string &outdir);
@@ -142,6 +285,8 @@ struct SequenceEncoder{
     void operator()(int code, vector<int> &sequence);
 
     int char_voc_size();
+
+    size_t memory_usage();
 };
 
 
@@ -101,9 +101,10 @@ def do_experiment(param):
     hyperfile = "{}/hyperparameters_orig".format(modeldir)
     print_hyperparameters(hyperfile, param)
     
-    train_command_line = '../bin/main -m train -t {t} -d {d} -p {hyp} -i {i} -o {modelname} -M {multi} > {modelname}/log.txt'
+    train_command_line = '../bin/main -m train -t {t} -d {d} -p {hyp} -i {i} -o {modelname} -M {multi} --corpus-cache {cache} > {modelname}/log.txt'
     train_command_line = train_command_line.format(t=train,
                                                    d=dev,
+                                                   cache="{}/{}/corpus.bin".format(args.output, param["lang"]),
                                                    hyp=hyperfile,
                                                    i=args.iterations,
                                                    modelname=modeldir,